@@ -14,6 +14,7 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include "actiondb.h"
+#include "matcher.h"
 #include "main.h"
 #include "win.h"
 #include <glibmm/i18n.h>
@@ -21,6 +22,10 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <ctime>
+#include <atomic>
+#include <thread>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/xml_oarchive.hpp>
@@ -151,6 +156,11 @@ template<class Archive> void ActionListDiff::serialize(Archive & ar, const unsig
 	if (version == 0)
 		return;
 	ar & boost::serialization::make_nvp("order", order);
+	if (version < 2)
+		return;
+	ar & boost::serialization::make_nvp("usage", usage);
+	if (version >= 3)
+		ar & boost::serialization::make_nvp("engine", engine);
 }
 
 ActionDB::ActionDB() {
@@ -186,8 +196,12 @@ template<class Archive> void ActionDB::save(Archive & ar, const unsigned int ver
 }
 
 Source<bool> action_dummy;
+static Source<bool> usage_dummy;
+static unsigned int actions_generation = 1;
 
 void update_actions() {
+	actions_generation++;
+	CompareCache::clear();
 	action_dummy.set(false);
 }
 
@@ -217,9 +231,12 @@ void ActionDBWatcher::init() {
 			break;
 		}
 	watch(action_dummy);
+	usage_watcher.watch(usage_dummy);
 }
 
 void ActionDBWatcher::timeout() {
+	// The usage goes out with everything else
+	usage_watcher.cancel();
 	std::string filename = config_dir+"actions"+actions_versions[0];
 	std::string tmp = filename + ".tmp";
 	try {
@@ -311,32 +328,335 @@ void ActionListDiff::all_strokes(std::list<RStroke> &strokes) const {
 		i->all_strokes(strokes);
 }
 
-RAction ActionListDiff::handle(RStroke s, RRanking &r) const {
+const ActionListDiff::Index &ActionListDiff::get_index() const {
+	int prototypes = prefs.prototypes.get();
+	const Recognizer *engine = recognizer();
+	if (index_generation == actions_generation && index_prototypes == prototypes && index_engine == engine) {
+		collect_prototypes();
+		return index;
+	}
+	index.clear();
+	index_strokes.reset(new std::vector<RStroke>);
+	extras.clear();
+	condense_job.reset();
+	boost::shared_ptr<std::map<Unique *, StrokeSet> > strokes = get_strokes();
+	for (std::map<Unique *, StrokeSet>::const_iterator i = strokes->begin(); i!=strokes->end(); i++)
+		for (StrokeSet::iterator j = i->second.begin(); j!=i->second.end(); j++) {
+			index_strokes->push_back(*j);
+			Candidate c = { i->first, j->get(), 0 };
+			Bucket &bucket = index[CandidateKey(**j)];
+			if (!bucket.cands)
+				bucket.cands.reset(new std::vector<Candidate>);
+			bucket.cands->push_back(c);
+			const float *e = (*j)->stroke ? stroke_get_embedding((*j)->stroke.get()) : nullptr;
+			for (int d = 0; d < STROKE_EMBEDDING_SIZE; d++)
+				bucket.embeddings.push_back(e ? e[d] : 0.0f);
+		}
+	for (Index::iterator i = index.begin(); i != index.end(); i++) {
+		Bucket &bucket = i->second;
+		std::vector<size_t> perm(bucket.cands->size());
+		for (size_t k = 0; k < perm.size(); k++)
+			perm[k] = k;
+		std::stable_sort(perm.begin(), perm.end(), [&](size_t a, size_t b) {
+			return get_usage((*bucket.cands)[a].id).beats(get_usage((*bucket.cands)[b].id));
+		});
+		Bucket sorted;
+		sorted.cands.reset(new std::vector<Candidate>);
+		for (size_t k = 0; k < perm.size(); k++) {
+			sorted.cands->push_back((*bucket.cands)[perm[k]]);
+			const float *e = &bucket.embeddings[perm[k] * STROKE_EMBEDDING_SIZE];
+			sorted.embeddings.insert(sorted.embeddings.end(), e, e + STROKE_EMBEDDING_SIZE);
+		}
+		bucket = sorted;
+	}
+	if (prototypes > 0)
+		condense(prototypes, engine);
+	index_generation = actions_generation;
+	index_prototypes = prototypes;
+	index_engine = engine;
+	return index;
+}
+
+// Only touches its own data and the strokes, which it keeps alive.  A job
+// that is outdated before it is done is cancelled, and the thread is joined
+// when the job goes away, so that it never outlives the list or main().
+struct CondenseJob {
+	std::vector<std::vector<const Stroke *> > groups;
+	boost::shared_ptr<const std::vector<RStroke> > strokes;
+	std::vector<std::vector<size_t> > prototypes;
+	std::atomic<bool> done;
+	std::atomic<bool> cancel;
+	std::thread thread;
+	CondenseJob() : done(false), cancel(false) {}
+	void run(int k, const Recognizer *rec);
+	~CondenseJob() {
+		cancel = true;
+		if (thread.joinable())
+			thread.join();
+	}
+};
+
+void CondenseJob::run(int k, const Recognizer *rec) {
+	stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+	bool complete = find_prototypes(groups, k, rec, ctx, cancel, prototypes);
+	stroke_compare_ctx_free(ctx);
+	done = complete;
+}
+
+// The examples of an action are condensed separately in each bucket
+void ActionListDiff::condense(int k, const Recognizer *rec) const {
+	boost::shared_ptr<CondenseJob> job(new CondenseJob);
+	job->strokes = index_strokes;
+	std::vector<std::vector<const Stroke *> > &groups = job->groups;
+	for (Index::const_iterator i = index.begin(); i != index.end(); i++) {
+		std::map<Unique *, std::vector<const Stroke *> > examples;
+		for (std::vector<Candidate>::const_iterator j = i->second.cands->begin(); j != i->second.cands->end(); j++)
+			examples[j->id].push_back(j->stroke);
+		for (std::map<Unique *, std::vector<const Stroke *> >::iterator j = examples.begin(); j != examples.end(); j++)
+			if (j->second.size() > (size_t)k)
+				groups.push_back(j->second);
+	}
+	if (groups.empty())
+		return;
+	job->thread = std::thread(&CondenseJob::run, job.get(), k, rec);
+	condense_job = job;
+}
+
+void ActionListDiff::collect_prototypes() const {
+	if (!condense_job || !condense_job->done)
+		return;
+	const std::vector<std::vector<const Stroke *> > &groups = condense_job->groups;
+	const std::vector<std::vector<size_t> > &prototypes = condense_job->prototypes;
+	for (size_t g = 0; g < groups.size(); g++) {
+		std::vector<bool> keep(groups[g].size(), false);
+		for (size_t i = 0; i < prototypes[g].size(); i++)
+			keep[prototypes[g][i]] = true;
+		for (size_t i = 0; i < groups[g].size(); i++)
+			if (!keep[i])
+				extras.insert(groups[g][i]);
+	}
+	condense_job.reset();
+}
+
+const Usage &ActionListDiff::get_usage(Unique *id) const {
+	static const Usage none;
+	std::map<Unique *, Usage>::const_iterator i = usage.find(id);
+	return i == usage.end() ? none : i->second;
+}
+
+// The candidates of id only ever move forward, so they can be bubbled into
+// place.  Rankings may still refer to the old order, so buckets are copied
+// before they are changed.
+void ActionListDiff::record_use(Unique *id) const {
+	Usage &u = usage[id];
+	u.hits++;
+	u.last_used = time(nullptr);
+	usage_dummy.set(false);
+	if (index_generation != actions_generation)
+		return;
+	for (Index::iterator i = index.begin(); i != index.end(); i++) {
+		Bucket &bucket = i->second;
+		for (size_t k = 0; k < bucket.cands->size(); k++) {
+			if ((*bucket.cands)[k].id != id)
+				continue;
+			size_t j = k;
+			while (j > 0 && u.beats(get_usage((*bucket.cands)[j-1].id)))
+				j--;
+			if (j == k)
+				continue;
+			if (!bucket.cands.unique())
+				bucket.cands.reset(new std::vector<Candidate>(*bucket.cands));
+			std::vector<Candidate> &cands = *bucket.cands;
+			std::rotate(cands.begin() + j, cands.begin() + k, cands.begin() + k + 1);
+			std::vector<float>::iterator e = bucket.embeddings.begin();
+			std::rotate(e + j * STROKE_EMBEDDING_SIZE, e + k * STROKE_EMBEDDING_SIZE, e + (k + 1) * STROKE_EMBEDDING_SIZE);
+		}
+	}
+}
+
+Ranking::Ranking(const ActionListDiff *list_, boost::shared_ptr<const std::vector<Candidate> > candidates_,
+		boost::shared_ptr<const std::vector<RStroke> > strokes_) :
+	list(list_), generation(actions_generation), partial(false), r(prefs.ranking_size.get()),
+	candidates(candidates_), strokes(strokes_) {}
+
+// Shares ownership with strokes, so the result stays valid after the index
+// has been rebuilt
+RStroke Ranking::get_stroke(int index) const {
+	return RStroke(strokes, const_cast<Stroke *>((*candidates)[index].stroke));
+}
+
+std::string Ranking::get_name(const TopK::Entry &e) const {
+	if (generation != actions_generation)
+		return "";
+	return list->get_info((*candidates)[e.index].id)->name;
+}
+
+const Recognizer *ActionListDiff::recognizer() const {
+	for (const ActionListDiff *l = this; l; l = l->parent)
+		if (!l->engine.empty())
+			return Recognizer::get(l->engine);
+	return Recognizer::dtw();
+}
+
+struct PrematchOrder {
+	const Prematch &p;
+	PrematchOrder(const Prematch &p_) : p(p_) {}
+	double get(const Candidate &c) const {
+		std::map<const Stroke *, double>::const_iterator i = p.scores.find(c.stroke);
+		return i == p.scores.end() ? -1.0 : i->second;
+	}
+	bool operator()(const Candidate &a, const Candidate &b) const { return get(a) > get(b); }
+};
+
+// Sorts cands by how close their embeddings come to that of s, closest first
+static void order_by_shape(const Stroke *s, std::vector<Candidate> &cands) {
+	if (!s->stroke)
+		return;
+	const float *e = stroke_get_embedding(s->stroke.get());
+	std::vector<std::pair<float, size_t> > keys;
+	for (size_t k = 0; k < cands.size(); k++) {
+		float dot = -2.0f;
+		if (cands[k].stroke->stroke) {
+			const float *f = stroke_get_embedding(cands[k].stroke->stroke.get());
+			dot = 0.0f;
+			for (int d = 0; d < STROKE_EMBEDDING_SIZE; d++)
+				dot += e[d] * f[d];
+		}
+		keys.push_back(std::make_pair(-dot, k));
+	}
+	std::stable_sort(keys.begin(), keys.end());
+	std::vector<Candidate> sorted;
+	sorted.reserve(cands.size());
+	for (size_t k = 0; k < keys.size(); k++)
+		sorted.push_back(cands[keys[k].second]);
+	cands.swap(sorted);
+}
+
+// Prematching runs on the main loop while the stroke is being drawn, so it
+// must not hold up motion events for long
+static const int prematch_budget = 2000;
+
+// Roughly how many comparisons fit in the budget at the default resolution
+// (about 20µs each).  Smaller buckets are cheap enough to score after the
+// button is released.
+static const size_t prematch_candidates = prematch_budget / 20;
+
+bool ActionListDiff::worth_prematching(const Stroke &s) const {
+	if (index_generation != actions_generation)
+		return false;
+	Index::const_iterator bucket = index.find(CandidateKey(s));
+	return bucket != index.end() && bucket->second.cands->size() > prematch_candidates;
+}
+
+// Candidates are visited in the order of their embeddings, so the likely
+// ones are scored before the budget runs out.  Those that weren't reached
+// are left out of p, as are those that didn't match.
+void ActionListDiff::prematch(RStroke s, Prematch &p) const {
+	p.scores.clear();
+	p.generation = actions_generation;
+	if (!s)
+		return;
+	const Index &index = get_index();
+	Index::const_iterator bucket = index.find(CandidateKey(*s));
+	if (bucket == index.end())
+		return;
+	Deadline deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(prematch_budget);
+	std::vector<Candidate> cands(*bucket->second.cands);
+	order_by_shape(s.get(), cands);
+	std::vector<Score> scores;
+	score_candidates(s.get(), false, recognizer(), cands, scores, deadline);
+	for (size_t k = 0; k < cands.size(); k++)
+		if (scores[k].match >= 0)
+			p.scores[cands[k].stroke] = scores[k].score;
+}
+
+static Deadline get_deadline() {
+	int budget = prefs.recognition_budget.get();
+	if (budget <= 0)
+		return Deadline::max();
+	return std::chrono::steady_clock::now() + std::chrono::microseconds(budget);
+}
+
+// Counts how often recognition ran out of time
+static void log_deadline(size_t candidates) {
+	static unsigned long missed = 0;
+	missed++;
+	g_message("Ran out of time with %zu candidates (%lu times so far)\n", candidates, missed);
+}
+
+// Candidates come in the order of the index, most used first, so the likely
+// winner sets a high min_score early on.  If p is given, the candidates
+// that scored best against the unfinished stroke are compared first.  The cutoff they establish lets most of the
+// remaining comparisons stop early, but the ranking then only lists the
+// candidates that improved on the ones before them in that order.
+//
+// If prefs.recognition_budget is set, candidates that aren't in p follow in
+// the order of their embeddings, and recognition settles for the best match
+// found when the budget runs out.
+RAction ActionListDiff::handle(RStroke s, RRanking &r, const Prematch *p) const {
 	if (!s)
 		return RAction();
-	r.reset(new Ranking);
+	const Index &index = get_index();
+	Deadline deadline = get_deadline();
+	Index::const_iterator bucket = index.find(CandidateKey(*s));
+	static const boost::shared_ptr<std::vector<Candidate> > none(new std::vector<Candidate>);
+	boost::shared_ptr<std::vector<Candidate> > bucket_cands = none;
+	const Recognizer *rec = recognizer();
+	if (bucket != index.end()) {
+		bucket_cands = bucket->second.cands;
+		int k = prefs.retrieval_k.get();
+		if (k > 0)
+			bucket_cands = retrieve(s.get(), bucket_cands, bucket->second.embeddings, k);
+		double margin = prefs.coarse_margin.get();
+		if (margin > 0.0 && rec == Recognizer::dtw())
+			bucket_cands = coarse_filter(s.get(), false, bucket_cands, margin, deadline);
+	}
+	bool timed = deadline != Deadline::max();
+	bool prematched = p && !p->scores.empty() && p->generation == actions_generation;
+	if ((timed || prematched) && bucket_cands->size() > 1) {
+		bucket_cands.reset(new std::vector<Candidate>(*bucket_cands));
+		if (timed)
+			order_by_shape(s.get(), *bucket_cands);
+		if (prematched)
+			std::stable_sort(bucket_cands->begin(), bucket_cands->end(), PrematchOrder(*p));
+	}
+	std::vector<Score> scores;
+	bool complete = extras.empty() ?
+		score_candidates(s.get(), false, rec, *bucket_cands, scores, deadline) :
+		score_condensed(s.get(), false, rec, extras, prefs.prototype_margin.get(), bucket_cands, scores, deadline);
+	const std::vector<Candidate> &cands = *bucket_cands;
+	r.reset(new Ranking(this, bucket_cands, index_strokes));
 	r->stroke = s;
 	r->score = 0.0;
-	boost::shared_ptr<std::map<Unique *, StrokeSet> > strokes = get_strokes();
-	for (std::map<Unique *, StrokeSet>::const_iterator i = strokes->begin(); i!=strokes->end(); i++) {
-		for (StrokeSet::iterator j = i->second.begin(); j!=i->second.end(); j++) {
-			double score;
-			int match = Stroke::compare(s, *j, score);
-			if (match < 0)
-				continue;
-			RStrokeInfo si = get_info(i->first);
-			r->r.insert(pair<double, pair<std::string, RStroke> >
-					(score, pair<std::string, RStroke>(si->name, *j)));
-			if (score > r->score) {
-				r->score = score;
-				if (match) {
-					r->name = si->name;
-					r->action = si->action;
-					r->best_stroke = *j;
-				}
+	if (!complete) {
+		r->partial = true;
+		log_deadline(cands.size());
+	}
+	Unique *winner = nullptr;
+	for (size_t k = 0; k < cands.size(); k++) {
+		if (!scores[k].beats(r->score))
+			continue;
+		double score = scores[k].score;
+		int match = scores[k].match;
+		r->r.insert(score, k);
+		if (score > r->score) {
+			r->score = score;
+			if (match) {
+				RStrokeInfo si = get_info(cands[k].id);
+				r->name = si->name;
+				r->action = si->action;
+				r->best_stroke = r->get_stroke(k);
+				winner = cands[k].id;
 			}
 		}
 	}
+	// Only what Stats is going to show.  The cache holds DTW results, which
+	// the debug view traces the path of.
+	if (rec == Recognizer::dtw())
+		for (TopK::iterator i = r->r.begin(); i != r->r.end(); i++)
+			CompareCache::store(s, r->get_stroke(*i), scores[i->index].match, i->score, scores[i->index].cost);
+	if (winner)
+		record_use(winner);
 	if (!r->action && s->trivial())
 		return RAction(new Click);
 	if (r->action) {
@@ -351,42 +671,76 @@ void ActionListDiff::handle_advanced(RStroke s, std::map<guint, RAction> &as,
 		std::map<guint, RRanking> &rs, int b1, int b2) const {
 	if (!s)
 		return;
-	boost::shared_ptr<std::map<Unique *, StrokeSet> > strokes = get_strokes();
-	for (std::map<Unique *, StrokeSet>::const_iterator i = strokes->begin(); i!=strokes->end(); i++) {
-		for (StrokeSet::iterator j = i->second.begin(); j!=i->second.end(); j++) {
-			int b = (*j)->button;
-			if (!s->timeout && !b)
-				continue;
-			s->button = b;
-			double score;
-			int match = Stroke::compare(s, *j, score);
-			if (match < 0)
-				continue;
-			Ranking *r;
-			if (b == b1)
-				b = b2;
-			if (rs.count(b)) {
-				r = rs[b].get();
-			} else {
-				r = new Ranking;
-				rs[b].reset(r);
-				r->stroke = RStroke(new Stroke(*s));
-				r->score = -1;
-			}
-			RStrokeInfo si = get_info(i->first);
-			r->r.insert(pair<double, pair<std::string, RStroke> >
-					(score, pair<std::string, RStroke>(si->name, *j)));
-			if (score > r->score) {
-				r->score = score;
-				if (match) {
-					r->name = si->name;
-					r->action = si->action;
-					r->best_stroke = *j;
-					as[b] = si->action;
-				}
+	const Index &index = get_index();
+	Deadline deadline = get_deadline();
+	// s takes on the button of each candidate, so visit all buttons
+	boost::shared_ptr<std::vector<Candidate> > all_cands(new std::vector<Candidate>);
+	CandidateKey key(*s);
+	key.button = 0;
+	for (Index::const_iterator i = index.lower_bound(key); i != index.end(); i++) {
+		if (i->first.timeout != key.timeout || i->first.trigger != key.trigger || i->first.modifiers != key.modifiers)
+			break;
+		int b = i->first.button;
+		if (!s->timeout && !b)
+			continue;
+		for (std::vector<Candidate>::const_iterator j = i->second.cands->begin(); j != i->second.cands->end(); j++) {
+			Candidate c = *j;
+			c.group = b == b1 ? b2 : b;
+			all_cands->push_back(c);
+		}
+	}
+	const Recognizer *rec = recognizer();
+	double margin = prefs.coarse_margin.get();
+	if (margin > 0.0 && rec == Recognizer::dtw())
+		all_cands = coarse_filter(s.get(), true, all_cands, margin, deadline);
+	if (deadline != Deadline::max())
+		order_by_shape(s.get(), *all_cands);
+	std::vector<Score> scores;
+	bool complete = extras.empty() ?
+		score_candidates(s.get(), true, rec, *all_cands, scores, deadline) :
+		score_condensed(s.get(), true, rec, extras, prefs.prototype_margin.get(), all_cands, scores, deadline);
+	const std::vector<Candidate> &cands = *all_cands;
+	// The handler runs the action of b2 right away; the other buttons only
+	// count once they are pressed, which this list doesn't get to see
+	Unique *winner = nullptr;
+	for (size_t k = 0; k < cands.size(); k++) {
+		guint b = cands[k].group;
+		s->button = cands[k].stroke->button;
+		std::map<guint, RRanking>::const_iterator i = rs.find(b);
+		if (!scores[k].beats(i == rs.end() ? 0.0 : i->second->score))
+			continue;
+		double score = scores[k].score;
+		int match = scores[k].match;
+		Ranking *r;
+		if (rs.count(b)) {
+			r = rs[b].get();
+		} else {
+			r = new Ranking(this, all_cands, index_strokes);
+			rs[b].reset(r);
+			r->stroke = RStroke(new Stroke(*s));
+			r->score = -1;
+		}
+		r->r.insert(score, k);
+		if (score > r->score) {
+			r->score = score;
+			if (match) {
+				RStrokeInfo si = get_info(cands[k].id);
+				r->name = si->name;
+				r->action = si->action;
+				r->best_stroke = r->get_stroke(k);
+				as[b] = si->action;
+				if (b == (guint)b2)
+					winner = cands[k].id;
 			}
 		}
 	}
+	if (winner)
+		record_use(winner);
+	if (!complete) {
+		for (std::map<guint, RRanking>::iterator i = rs.begin(); i != rs.end(); i++)
+			i->second->partial = true;
+		log_deadline(cands.size());
+	}
 }
 
 ActionListDiff::~ActionListDiff() {
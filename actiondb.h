@@ -24,6 +24,7 @@
 #include <iostream>
 
 #include "gesture.h"
+#include "matcher.h"
 #include "prefdb.h"
 
 class Action;
@@ -207,15 +208,32 @@ public:
 typedef boost::shared_ptr<StrokeInfo> RStrokeInfo;
 BOOST_CLASS_VERSION(StrokeInfo, 1)
 
+class ActionListDiff;
+
 class Ranking {
 	static bool show(RRanking r);
 	int x, y;
+	const ActionListDiff *list;
+	unsigned int generation;
 public:
 	RStroke stroke, best_stroke;
 	RAction action;
 	double score;
 	std::string name;
-	std::multimap<double, std::pair<std::string, RStroke> > r;
+	// Whether recognition ran out of time before it had tried every candidate
+	bool partial;
+	// The best of the candidates that were tried, as indices into
+	// candidates.  Their names are only looked up for display.
+	TopK r;
+	boost::shared_ptr<const std::vector<Candidate> > candidates;
+	// Keeps the strokes of candidates alive
+	boost::shared_ptr<const std::vector<RStroke> > strokes;
+	Ranking(const ActionListDiff *list, boost::shared_ptr<const std::vector<Candidate> > candidates,
+			boost::shared_ptr<const std::vector<RStroke> > strokes);
+	RStroke get_stroke(int index) const;
+	RStroke get_stroke(const TopK::Entry &e) const { return get_stroke(e.index); }
+	// Empty if the actions have been modified in the meantime
+	std::string get_name(const TopK::Entry &e) const;
 	static void queue_show(RRanking r, RTriple e);
 };
 
@@ -227,6 +245,50 @@ public:
 	int i;
 };
 
+// The attributes that Stroke::compare requires to be equal
+struct CandidateKey {
+	bool timeout;
+	int trigger;
+	unsigned int modifiers;
+	int button;
+	CandidateKey(const Stroke &s) : timeout(s.timeout), trigger(s.trigger), modifiers(s.modifiers), button(s.button) {}
+	bool operator<(const CandidateKey &k) const {
+		if (timeout != k.timeout)
+			return timeout < k.timeout;
+		if (trigger != k.trigger)
+			return trigger < k.trigger;
+		if (modifiers != k.modifiers)
+			return modifiers < k.modifiers;
+		return button < k.button;
+	}
+};
+
+// How often an action has been recognized in an action list, and when it
+// was last
+struct Usage {
+	unsigned int hits;
+	long last_used;
+	Usage() : hits(0), last_used(0) {}
+	bool beats(const Usage &u) const {
+		return hits != u.hits ? hits > u.hits : last_used > u.last_used;
+	}
+	template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+		ar & boost::serialization::make_nvp("hits", hits);
+		ar & boost::serialization::make_nvp("last_used", last_used);
+	}
+};
+
+// Provisional scores of database strokes, taken from a stroke that was still
+// being drawn.  Only used to decide which candidates to compare first, and
+// only as long as the actions haven't changed since.
+struct Prematch {
+	std::map<const Stroke *, double> scores;
+	unsigned int generation;
+	Prematch() : generation(0) {}
+};
+
+struct CondenseJob;
+
 class ActionListDiff {
 	friend class boost::serialization::access;
 	friend class ActionDB;
@@ -237,6 +299,37 @@ class ActionListDiff {
 	std::list<Unique *> order;
 	std::list<ActionListDiff> children;
 
+	// Recognitions in this list, by action
+	mutable std::map<Unique *, Usage> usage;
+	const Usage &get_usage(Unique *id) const;
+
+	// All strokes of this list, by attributes, along with their embeddings.
+	// Rebuilt lazily after update_actions() has been called.  Candidates
+	// are ordered by usage, most used first; record_use() keeps them that
+	// way.  index_strokes owns the strokes that the candidates point to.
+	struct Bucket {
+		boost::shared_ptr<std::vector<Candidate> > cands;
+		std::vector<float> embeddings;
+	};
+	typedef std::map<CandidateKey, Bucket> Index;
+	mutable Index index;
+	mutable boost::shared_ptr<std::vector<RStroke> > index_strokes;
+	mutable unsigned int index_generation;
+	// With prefs.prototypes set, the strokes that aren't among the
+	// prototypes of their action.  They are picked on a thread of their own
+	// after the index has been rebuilt; until condense_job is done, all
+	// candidates are compared.
+	mutable std::set<const Stroke *> extras;
+	mutable boost::shared_ptr<CondenseJob> condense_job;
+	mutable int index_prototypes;
+	mutable const Recognizer *index_engine;
+	const Index &get_index() const;
+	void condense(int k, const Recognizer *rec) const;
+	void collect_prototypes() const;
+	void record_use(Unique *id) const;
+	// The engine of this list or of the closest ancestor that sets one
+	const Recognizer *recognizer() const;
+
 	void update_order() {
 		int j = 0;
 		for (std::list<Unique *>::iterator i = order.begin(); i != order.end(); i++, j++) {
@@ -261,8 +354,10 @@ public:
 	int level;
 	bool app;
 	std::string name;
+	// Name of the recognizer engine, empty to use that of the parent
+	std::string engine;
 
-	ActionListDiff() : parent(0), level(0), app(false) {}
+	ActionListDiff() : parent(0), index_generation(0), index_prototypes(0), index_engine(0), level(0), app(false) {}
 
 	typedef std::list<ActionListDiff>::iterator iterator;
 	iterator begin() { return children.begin(); }
@@ -310,6 +405,7 @@ public:
 			update_order();
 		} else
 			deleted.insert(id);
+		usage.erase(id);
 		for (std::list<ActionListDiff>::iterator i = children.begin(); i != children.end(); i++)
 			i->remove(id);
 		return really;
@@ -372,13 +468,17 @@ public:
 		return (parent ? parent->count_actions() : 0) + order.size() - deleted.size();
 	}
 	void all_strokes(std::list<RStroke> &strokes) const;
-	RAction handle(RStroke s, RRanking &r) const;
+	// Whether prematch() could get through less than the bucket of s in its
+	// budget.  Never rebuilds the index.
+	bool worth_prematching(const Stroke &s) const;
+	void prematch(RStroke s, Prematch &p) const;
+	RAction handle(RStroke s, RRanking &r, const Prematch *p = nullptr) const;
 	// b1 is always reported as b2
 	void handle_advanced(RStroke s, std::map<guint, RAction> &a, std::map<guint, RRanking> &r, int b1, int b2) const;
 
 	~ActionListDiff();
 };
-BOOST_CLASS_VERSION(ActionListDiff, 1)
+BOOST_CLASS_VERSION(ActionListDiff, 3)
 
 class ActionDB {
 	friend class boost::serialization::access;
@@ -408,10 +508,23 @@ BOOST_CLASS_VERSION(ActionDB, 3)
 
 class ActionDBWatcher : public TimeoutWatcher {
 	bool good_state;
+	// Usage changes with every gesture, so it is saved less eagerly
+	class UsageWatcher : public TimeoutWatcher {
+		ActionDBWatcher &db;
+	public:
+		UsageWatcher(ActionDBWatcher &db_) : TimeoutWatcher(60000), db(db_) {}
+		virtual void timeout() { db.timeout(); }
+	} usage_watcher;
 public:
-	ActionDBWatcher() : TimeoutWatcher(5000), good_state(true) {}
+	ActionDBWatcher() : TimeoutWatcher(5000), good_state(true), usage_watcher(*this) {}
 	void init();
 	virtual void timeout();
+	// Writes the database once if either change is pending
+	void flush() {
+		bool usage = usage_watcher.cancel();
+		if (cancel() || usage)
+			timeout();
+	}
 };
 
 extern ActionDB actions;
@@ -22,6 +22,7 @@
 #include <X11/XKBlib.h>
 #include "grabber.h"
 #include "cellrenderertextish.h"
+#include "recognizer.h"
 
 #include <typeinfo>
 
@@ -225,6 +226,20 @@ Actions::Actions() :
 	app_name_renderer->signal_edited().connect(sigc::mem_fun(*this, &Actions::on_group_name_edited));
 	apps_view->append_column(_("Actions"), ca.count);
 
+	engine_store = Gtk::ListStore::create(type);
+	(*(engine_store->append()))[type.type] = _("Inherit");
+	std::vector<const Recognizer *> engines = Recognizer::all();
+	for (std::vector<const Recognizer *>::iterator i = engines.begin(); i != engines.end(); i++)
+		(*(engine_store->append()))[type.type] = (*i)->name();
+	Gtk::CellRendererCombo *engine_renderer = Gtk::manage(new Gtk::CellRendererCombo);
+	engine_renderer->property_model() = engine_store;
+	engine_renderer->property_editable() = true;
+	engine_renderer->property_text_column() = 0;
+	engine_renderer->property_has_entry() = false;
+	engine_renderer->signal_edited().connect(sigc::mem_fun(*this, &Actions::on_engine_edited));
+	n = apps_view->append_column(_("Recognizer"), *engine_renderer);
+	apps_view->get_column(n-1)->add_attribute(engine_renderer->property_text(), ca.engine);
+
 	apps_view->set_model(apps_model);
 	apps_view->enable_model_drag_dest();
 	apps_view->expand_all();
@@ -234,6 +249,10 @@ void Actions::load_app_list(const Gtk::TreeNodeChildren &ch, ActionListDiff *act
 	Gtk::TreeRow row = *(apps_model->append(ch));
 	row[ca.app] = app_name_hr(actions->name);
 	row[ca.actions] = actions;
+	if (actions->engine.empty())
+		row[ca.engine] = _("Inherit");
+	else
+		row[ca.engine] = actions->engine;
 	for (ActionListDiff::iterator i = actions->begin(); i != actions->end(); i++)
 		load_app_list(row.children(), &(*i));
 }
@@ -539,6 +558,7 @@ void Actions::on_add_app() {
 	Gtk::TreeRow row = *(apps_model->append(ch));
 	row[ca.app] = app_name_hr(name);
 	row[ca.actions] = child;
+	row[ca.engine] = _("Inherit");
 	actions.apps[name] = child;
 	Gtk::TreePath path = apps_model->get_path(row);
 	apps_view->expand_to_path(path);
@@ -596,6 +616,7 @@ void Actions::on_add_group() {
 	Gtk::TreeRow row = *(apps_model->append(ch));
 	row[ca.app] = name;
 	row[ca.actions] = child;
+	row[ca.engine] = _("Inherit");
 	actions.apps[name] = child;
 	Gtk::TreePath path = apps_model->get_path(row);
 	apps_view->expand_to_path(path);
@@ -611,6 +632,17 @@ void Actions::on_group_name_edited(const Glib::ustring& path, const Glib::ustrin
 	update_actions();
 }
 
+void Actions::on_engine_edited(const Glib::ustring& path, const Glib::ustring& new_text) {
+	Gtk::TreeRow row(*apps_model->get_iter(path));
+	row[ca.engine] = new_text;
+	ActionListDiff *as = row[ca.actions];
+	if (new_text == _("Inherit"))
+		as->engine.clear();
+	else
+		as->engine = new_text;
+	update_actions();
+}
+
 void Actions::on_expanded() {
 	if (expander_apps->get_expanded()) {
 		vpaned_apps->set_position(vpaned_position);
@@ -70,6 +70,7 @@ private:
 	void on_add_app();
 	void on_add_group();
 	void on_group_name_edited(const Glib::ustring& path, const Glib::ustring& new_text);
+	void on_engine_edited(const Glib::ustring& path, const Glib::ustring& new_text);
 	void on_apps_selection_changed();
 	void on_expanded();
 	void load_app_list(const Gtk::TreeNodeChildren &ch, ActionListDiff *actions);
@@ -132,8 +133,8 @@ private:
 
 	class Apps : public Gtk::TreeModel::ColumnRecord {
 	public:
-		Apps() { add(app); add(actions); add(count); }
-		Gtk::TreeModelColumn<Glib::ustring> app;
+		Apps() { add(app); add(actions); add(count); add(engine); }
+		Gtk::TreeModelColumn<Glib::ustring> app, engine;
 		Gtk::TreeModelColumn<ActionListDiff *> actions;
 		Gtk::TreeModelColumn<int> count;
 	};
@@ -141,7 +142,7 @@ private:
 
 	struct Focus;
 
-	Glib::RefPtr<Gtk::ListStore> type_store;
+	Glib::RefPtr<Gtk::ListStore> type_store, engine_store;
 
 	Gtk::Button *button_record, *button_delete, *button_remove_app, *button_reset_actions;
 	Gtk::CheckButton *check_show_deleted;
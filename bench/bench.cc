@@ -0,0 +1,728 @@
+/*
+ * Copyright (c) 2008-2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Benchmark for the stroke matcher.  Only stroke.c is linked, so this builds
+// without GTK or X: gesture.h, which matcher.cc and recognizer.cc build on,
+// pulls in gdkmm, and matcher.cc reads its settings from prefdb.h.  What the
+// C++ side does is therefore redone here in a simplified form.  Recognition
+// is done the way Stroke::compare() and ActionListDiff::handle() do it:
+// strokes are grouped by the attributes that have to be equal, and each
+// candidate is compared with the best score so far as min_score after
+// running the same prefilters.
+//
+// Not measured, because they only exist on the C++ side:
+// - the WorkerPool and score_candidates().  With -p, each thread works
+//   through all queries on its own, without handing work to the pool and
+//   waiting for it after each query.
+// - the prototypes of score_condensed() and find_prototypes().
+// - the slack of score_range() and the anytime ordering of prematch().
+// - the deadlines of coarse_filter() and score_candidates().  -t only
+//   checks the time between the candidates of a serial pass.
+// - the index lookup and the Candidate copies of -k and -c.
+#include "stroke.h"
+
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+struct Sample {
+	std::vector<double> x, y;
+	int button, trigger, timeout;
+	unsigned int modifiers;
+	int source;
+	Sample() : button(0), trigger(0), timeout(0), modifiers(0), source(-1) {}
+	bool same_key(const Sample &s) const {
+		return button == s.button && trigger == s.trigger && timeout == s.timeout && modifiers == s.modifiers;
+	}
+};
+
+struct Options {
+	int points;
+	int db_size;
+	int queries;
+	int resample;
+	int retrieval_k;
+	double coarse_margin;
+	bool compact;
+	bool directions;
+	int budget;
+	int threads;
+	unsigned int seed;
+	Options() : points(64), db_size(100), queries(500), resample(0), retrieval_k(0), coarse_margin(0.0),
+		compact(false), directions(false), budget(0), threads(0), seed(1) {}
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_ns(Clock::time_point t0, Clock::time_point t1) {
+	return std::chrono::duration<double, std::nano>(t1 - t0).count();
+}
+
+// Shape families.  u runs from 0 to 1 along the stroke, p varies the shape
+// within its family.
+enum { TREFOIL, CIRCLE, LINE, CORNER, ZIGZAG, SPIRAL, WAVE, FAMILIES };
+
+static const char *family_names[FAMILIES] = { "trefoil", "circle", "line", "corner", "zigzag", "spiral", "wave" };
+
+static void family_point(int family, double u, double p, double &x, double &y) {
+	switch (family) {
+		case TREFOIL: {
+			// Same curve as Stroke::trefoil()
+			double phi = M_PI*(-4.0*u)-2.7;
+			double r = exp(1.0 + sin(6.0*M_PI*u)) + 2.0;
+			x = r*cos(phi);
+			y = r*sin(phi);
+			break;
+		}
+		case CIRCLE:
+			x = cos(p + 2.0*M_PI*u*(0.8 + 0.2*p));
+			y = sin(p + 2.0*M_PI*u*(0.8 + 0.2*p));
+			break;
+		case LINE:
+			x = u*cos(p*M_PI);
+			y = u*sin(p*M_PI);
+			break;
+		case CORNER:
+			x = u < 0.5 ? 2.0*u : 1.0;
+			y = u < 0.5 ? 0.0 : (2.0*u - 1.0)*(p < 0.5 ? 1.0 : -1.0);
+			break;
+		case ZIGZAG: {
+			int teeth = 2 + (int)(p*3);
+			double v = u*teeth;
+			x = u;
+			y = 0.3*fabs(v - floor(v) - 0.5);
+			break;
+		}
+		case SPIRAL:
+			x = (0.2 + u)*cos(6.0*M_PI*u + p);
+			y = (0.2 + u)*sin(6.0*M_PI*u + p);
+			break;
+		case WAVE:
+			x = u;
+			y = 0.25*sin(2.0*M_PI*u*(1.0 + 2.0*p));
+			break;
+	}
+}
+
+static Sample make_synthetic(int i, int points, std::mt19937 &rng) {
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	Sample s;
+	int family = i % FAMILIES;
+	double p = unit(rng);
+	double scale = 50.0 + 250.0*unit(rng);
+	double rot = family == TREFOIL ? 0.0 : 2.0*M_PI*unit(rng);
+	for (int k = 0; k < points; k++) {
+		double u = points > 1 ? (double)k/(points-1) : 0.0;
+		double x, y;
+		family_point(family, u, p, x, y);
+		s.x.push_back(scale*(x*cos(rot) - y*sin(rot)));
+		s.y.push_back(scale*(x*sin(rot) + y*cos(rot)));
+	}
+	return s;
+}
+
+// A noisy redrawing of s: every point is jittered and some are dropped, so
+// the query has a different number of points than its source.
+static Sample make_query(const Sample &s, int source, std::mt19937 &rng) {
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	std::normal_distribution<double> jitter(0.0, 1.5);
+	Sample q = s;
+	q.x.clear();
+	q.y.clear();
+	q.source = source;
+	double keep = 0.7 + 0.3*unit(rng);
+	for (size_t k = 0; k < s.x.size(); k++) {
+		if (k && k+1 < s.x.size() && unit(rng) > keep)
+			continue;
+		q.x.push_back(s.x[k] + jitter(rng));
+		q.y.push_back(s.y[k] + jitter(rng));
+	}
+	return q;
+}
+
+// Pulls the strokes out of an actions file as written by ActionDBWatcher.
+// Only the XML archive format is understood; strokes that are stored by
+// reference appear once, which is all the benchmark needs.
+static std::string element(const std::string &text, size_t &pos, const char *name, size_t end) {
+	std::string open = std::string("<") + name + ">";
+	std::string close = std::string("</") + name + ">";
+	size_t a = text.find(open, pos);
+	if (a == std::string::npos || a >= end)
+		return "";
+	a += open.size();
+	size_t b = text.find(close, a);
+	if (b == std::string::npos)
+		return "";
+	pos = b + close.size();
+	return text.substr(a, b - a);
+}
+
+static bool load_actions(const char *filename, std::vector<Sample> &db) {
+	std::ifstream ifs(filename);
+	if (!ifs)
+		return false;
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	std::string text = ss.str();
+	size_t pos = 0;
+	for (;;) {
+		size_t start = text.find("<points", pos);
+		if (start == std::string::npos)
+			break;
+		size_t end = text.find("</points>", start);
+		if (end == std::string::npos)
+			break;
+		Sample s;
+		size_t p = start;
+		for (;;) {
+			std::string x = element(text, p, "x", end);
+			std::string y = element(text, p, "y", end);
+			if (x.empty() || y.empty())
+				break;
+			s.x.push_back(atof(x.c_str()));
+			s.y.push_back(atof(y.c_str()));
+		}
+		pos = end;
+		size_t next = text.find("<points", end + 1);
+		if (next == std::string::npos)
+			next = text.size();
+		s.button = atoi(element(text, pos, "button", next).c_str());
+		s.trigger = atoi(element(text, pos, "trigger", next).c_str());
+		s.timeout = atoi(element(text, pos, "timeout", next).c_str());
+		s.modifiers = strtoul(element(text, pos, "modifiers", next).c_str(), nullptr, 10);
+		if (s.x.size() >= 2)
+			db.push_back(s);
+		pos = end;
+	}
+	return true;
+}
+
+static stroke_t *make_stroke(const Sample &s, int resample) {
+	stroke_t *st = stroke_alloc(s.x.size());
+	for (size_t k = 0; k < s.x.size(); k++)
+		stroke_add_point(st, s.x[k], s.y[k]);
+	if (resample >= 2)
+		stroke_finish_resampled(st, resample);
+	else
+		stroke_finish(st);
+	return st;
+}
+
+// The low resolution copy that Stroke::set_stroke() keeps
+static stroke_t *make_coarse(const stroke_t *s) {
+	stroke_t *c = stroke_alloc(stroke_get_size(s));
+	for (int i = 0; i < stroke_get_size(s); i++) {
+		double x, y;
+		stroke_get_point(s, i, &x, &y);
+		stroke_add_point(c, x, y);
+	}
+	if (stroke_get_size(s) > 16)
+		stroke_finish_resampled(c, 16);
+	else
+		stroke_finish(c);
+	return c;
+}
+
+static double cutoff(double min_score) {
+	return std::min((1.0 - min_score)/2.5, stroke_infinity);
+}
+
+struct Stats {
+	std::vector<double> latency;
+	unsigned long candidates, rejected, compared;
+	int correct;
+	double checksum;
+	Stats() : candidates(0), rejected(0), compared(0), correct(0), checksum(0.0) {}
+};
+
+// The database strokes that q can be compared with, in database order
+static std::vector<int> bucket(const Sample &q, const std::vector<Sample> &db) {
+	std::vector<int> b;
+	for (size_t j = 0; j < db.size(); j++)
+		if (q.same_key(db[j]))
+			b.push_back(j);
+	return b;
+}
+
+// Narrows cands down to the k nearest by embedding, as retrieve() does
+static std::vector<int> nearest(const stroke_t *a, const std::vector<int> &cands,
+		const std::vector<stroke_t *> &strokes, int k) {
+	if (cands.size() <= (size_t)k)
+		return cands;
+	std::vector<float> embeddings;
+	for (size_t i = 0; i < cands.size(); i++) {
+		const float *e = stroke_get_embedding(strokes[cands[i]]);
+		embeddings.insert(embeddings.end(), e, e + STROKE_EMBEDDING_SIZE);
+	}
+	std::vector<int> out(k);
+	k = stroke_nearest(stroke_get_embedding(a), embeddings.data(), cands.size(), k, out.data());
+	std::vector<int> result;
+	for (int i = 0; i < k; i++)
+		result.push_back(cands[out[i]]);
+	return result;
+}
+
+// Narrows cands down to those within margin of the best coarse score, as
+// coarse_filter() does: at cutoff(0) and without the prefilters.  A bucket
+// holds a single group, so the best score of the group is that of cands.
+static std::vector<int> coarse(stroke_compare_ctx_t *ctx, const stroke_t *a, const std::vector<int> &cands,
+		const std::vector<stroke_t *> &coarse_strokes, double margin) {
+	if (cands.size() < 2)
+		return cands;
+	std::vector<double> scores(cands.size());
+	double best = 0.0;
+	for (size_t i = 0; i < cands.size(); i++) {
+		double cost = stroke_compare_with(ctx, a, coarse_strokes[cands[i]], nullptr, nullptr, cutoff(0.0));
+		scores[i] = cost < stroke_infinity ? std::max(1.0 - 2.5*cost, 0.0) : 0.0;
+		best = std::max(best, scores[i]);
+	}
+	std::vector<int> result;
+	for (size_t i = 0; i < cands.size(); i++)
+		if (scores[i] >= best - margin)
+			result.push_back(cands[i]);
+	return result;
+}
+
+// One recognition pass over cands, as handle() does it.  Stops once the
+// deadline has passed, if there is one.
+static int recognize(stroke_compare_ctx_t *ctx, const stroke_t *a, const std::vector<int> &cands,
+		const std::vector<stroke_t *> &strokes, Stats &st, double &best,
+		Clock::time_point deadline = Clock::time_point::max()) {
+	best = 0.0;
+	int match = -1;
+	bool timed = deadline != Clock::time_point::max();
+	for (size_t i = 0; i < cands.size(); i++) {
+		if (timed && Clock::now() > deadline)
+			break;
+		int j = cands[i];
+		st.candidates++;
+		double c = cutoff(best);
+		if (stroke_bound_endpoints(a, strokes[j]) >= c || stroke_bound_histogram(a, strokes[j]) >= c) {
+			st.rejected++;
+			continue;
+		}
+		st.compared++;
+		double cost = stroke_compare_with(ctx, a, strokes[j], nullptr, nullptr, c);
+		if (cost >= stroke_infinity)
+			continue;
+		double score = std::max(1.0 - 2.5*cost, 0.0);
+		if (score > best) {
+			best = score;
+			match = j;
+		}
+	}
+	return match;
+}
+
+// The same with the "directions" engine, which has no use for prefilters
+static int recognize_directions(const stroke_t *a, const std::vector<int> &cands,
+		const std::vector<stroke_t *> &strokes, Stats &st, double &best) {
+	best = 0.0;
+	int match = -1;
+	for (size_t i = 0; i < cands.size(); i++) {
+		int j = cands[i];
+		st.candidates++;
+		st.compared++;
+		double cost = stroke_compare_directions(a, strokes[j]);
+		if (cost >= cutoff(best))
+			continue;
+		double score = std::max(1.0 - 2.5*cost, 0.0);
+		if (score > best) {
+			best = score;
+			match = j;
+		}
+	}
+	return match;
+}
+
+// Average time of comparing each of the first n queries with every stroke
+static double compare_pairs(stroke_compare_ctx_t *ctx, const std::vector<stroke_t *> &queries, size_t n,
+		const std::vector<stroke_t *> &strokes, double &sum) {
+	sum = 0.0;
+	Clock::time_point t0 = Clock::now();
+	for (size_t i = 0; i < n; i++)
+		for (size_t j = 0; j < strokes.size(); j++)
+			sum += stroke_compare_with(ctx, queries[i], strokes[j], nullptr, nullptr, stroke_infinity);
+	Clock::time_point t1 = Clock::now();
+	return elapsed_ns(t0, t1) / (n * strokes.size());
+}
+
+// Candidates as the matcher used to hold them, with a reference to the
+// stroke, and as it holds them now, with a plain pointer into storage that
+// the index owns
+struct HandleCandidate {
+	int id;
+	boost::shared_ptr<stroke_t> stroke;
+};
+
+struct ViewCandidate {
+	int id;
+	const stroke_t *stroke;
+};
+
+// Takes its arguments by value, as Stroke::compare() used to
+static __attribute__((noinline)) double compare_handles(stroke_compare_ctx_t *ctx, boost::shared_ptr<stroke_t> a,
+		boost::shared_ptr<stroke_t> b, double c) {
+	return stroke_compare_with(ctx, a.get(), b.get(), nullptr, nullptr, c);
+}
+
+static __attribute__((noinline)) double compare_views(stroke_compare_ctx_t *ctx, const stroke_t *a,
+		const stroke_t *b, double c) {
+	return stroke_compare_with(ctx, a, b, nullptr, nullptr, c);
+}
+
+// Recognizes every query on each of the given number of threads, with
+// thread i taking candidates i, i + threads, ... as score_candidates() does.
+// The candidates of a query are copied first, the way the filters and the
+// anytime ordering copy them.  Returns the time per candidate.
+template <class C, class Q, class F>
+static double score_shared(const std::vector<Q> &queries, const std::vector<std::vector<int> > &buckets,
+		const std::vector<C> &db, int threads, F compare, double &checksum) {
+	std::vector<double> sums(threads, 0.0);
+	Clock::time_point t0 = Clock::now();
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+		workers.push_back(std::thread([&, t]() {
+			stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+			for (size_t i = 0; i < queries.size(); i++) {
+				std::vector<C> cands;
+				for (size_t k = 0; k < buckets[i].size(); k++)
+					cands.push_back(db[buckets[i][k]]);
+				double best = 0.0;
+				for (size_t k = t; k < cands.size(); k += threads) {
+					double cost = compare(ctx, queries[i], cands[k].stroke, cutoff(best));
+					if (cost < stroke_infinity)
+						best = std::max(best, std::max(1.0 - 2.5*cost, 0.0));
+				}
+				sums[t] += best;
+			}
+			stroke_compare_ctx_free(ctx);
+		}));
+	for (int t = 0; t < threads; t++)
+		workers[t].join();
+	Clock::time_point t1 = Clock::now();
+	checksum = 0.0;
+	unsigned long n = 0;
+	for (int t = 0; t < threads; t++)
+		checksum += sums[t];
+	for (size_t i = 0; i < buckets.size(); i++)
+		n += buckets[i].size();
+	return elapsed_ns(t0, t1) / n;
+}
+
+static double percentile(std::vector<double> v, double p) {
+	if (v.empty())
+		return 0.0;
+	std::sort(v.begin(), v.end());
+	size_t i = (size_t)(p*(v.size()-1) + 0.5);
+	return v[i];
+}
+
+static void report(const char *what, const Stats &st, size_t queries) {
+	double total = 0.0;
+	for (size_t i = 0; i < st.latency.size(); i++)
+		total += st.latency[i];
+	printf("%-15s %10.1f us p50, %.1f us p99, %.0f candidates/s\n", what,
+			percentile(st.latency, 0.5) / 1000.0, percentile(st.latency, 0.99) / 1000.0,
+			st.candidates / (total * 1e-9));
+	printf("                %lu candidates, %lu rejected by prefilters, %lu compared\n",
+			st.candidates, st.rejected, st.compared);
+	printf("                %.1f%% matched their source (checksum %.6f)\n",
+			100.0 * st.correct / queries, st.checksum);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n points] [-d db size] [-q queries] [-r resample] [-k retrieval k] [-c coarse margin] [-z] [-e] [-t budget in us] [-p threads] [-s seed] [actions.xml...]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	Options o;
+	int c;
+	while ((c = getopt(argc, argv, "n:d:q:r:k:c:zet:p:s:h")) != -1)
+		switch (c) {
+			case 'n': o.points = atoi(optarg); break;
+			case 'd': o.db_size = atoi(optarg); break;
+			case 'q': o.queries = atoi(optarg); break;
+			case 'r': o.resample = atoi(optarg); break;
+			case 'k': o.retrieval_k = atoi(optarg); break;
+			case 'c': o.coarse_margin = atof(optarg); break;
+			case 'z': o.compact = true; break;
+			case 'e': o.directions = true; break;
+			case 't': o.budget = atoi(optarg); break;
+			case 'p': o.threads = atoi(optarg); break;
+			case 's': o.seed = strtoul(optarg, nullptr, 10); break;
+			default: usage(argv[0]);
+		}
+	std::mt19937 rng(o.seed);
+
+	std::vector<Sample> db;
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++)
+			if (!load_actions(argv[i], db)) {
+				fprintf(stderr, "Couldn't read %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		printf("database: %zu strokes from %d file(s)\n", db.size(), argc - optind);
+	} else {
+		for (int i = 0; i < o.db_size; i++)
+			db.push_back(make_synthetic(i, o.points, rng));
+		printf("database: %zu synthetic strokes of %d points (", db.size(), o.points);
+		for (int f = 0; f < FAMILIES; f++)
+			printf("%s%s", f ? ", " : "", family_names[f]);
+		printf(")\n");
+	}
+	if (db.empty() || o.queries <= 0) {
+		fprintf(stderr, "Nothing to do\n");
+		return EXIT_FAILURE;
+	}
+	if (o.resample >= 2)
+		printf("resampling to %d points\n", o.resample);
+
+	std::vector<Sample> queries;
+	std::uniform_int_distribution<int> pick(0, db.size() - 1);
+	for (int i = 0; i < o.queries; i++) {
+		int j = pick(rng);
+		queries.push_back(make_query(db[j], j, rng));
+	}
+
+	Clock::time_point t0 = Clock::now();
+	std::vector<stroke_t *> strokes;
+	for (size_t j = 0; j < db.size(); j++)
+		strokes.push_back(make_stroke(db[j], o.resample));
+	Clock::time_point t1 = Clock::now();
+	std::vector<stroke_t *> query_strokes;
+	for (size_t i = 0; i < queries.size(); i++)
+		query_strokes.push_back(make_stroke(queries[i], o.resample));
+	printf("stroke_finish:  %10.0f ns/stroke\n", elapsed_ns(t0, t1) / db.size());
+
+	stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+
+	// Full comparisons, without cutoff, of a subset of the pairs
+	size_t pair_queries = std::min<size_t>(queries.size(), std::max<size_t>(1, 20000 / db.size()));
+	unsigned long pairs = pair_queries * db.size();
+	double sum;
+	double ns = compare_pairs(ctx, query_strokes, pair_queries, strokes, sum);
+	printf("stroke_compare: %10.0f ns/compare (%lu pairs, checksum %.6f)\n", ns, pairs, sum);
+	if (o.resample == 16 || o.resample == 32 || o.resample == 64) {
+		stroke_use_fixed_size = 0;
+		double generic = compare_pairs(ctx, query_strokes, pair_queries, strokes, sum);
+		stroke_use_fixed_size = 1;
+		printf("  generic code: %10.0f ns/compare (checksum %.6f), %.2fx\n", generic, sum, generic / ns);
+	}
+
+	Stats st;
+	std::vector<int> winners;
+	for (size_t i = 0; i < queries.size(); i++) {
+		double best;
+		t0 = Clock::now();
+		int match = recognize(ctx, query_strokes[i], bucket(queries[i], db), strokes, st, best);
+		t1 = Clock::now();
+		st.latency.push_back(elapsed_ns(t0, t1));
+		st.checksum += best;
+		winners.push_back(match);
+		if (match == queries[i].source)
+			st.correct++;
+	}
+	report("recognition:", st, queries.size());
+
+	// Retrieval is approximate: recall is the share of queries for which
+	// it leads to the same winner as the exhaustive pass.
+	if (o.retrieval_k > 0) {
+		Stats rt;
+		int same = 0;
+		for (size_t i = 0; i < queries.size(); i++) {
+			double best;
+			t0 = Clock::now();
+			std::vector<int> cands = nearest(query_strokes[i], bucket(queries[i], db), strokes, o.retrieval_k);
+			int match = recognize(ctx, query_strokes[i], cands, strokes, rt, best);
+			t1 = Clock::now();
+			rt.latency.push_back(elapsed_ns(t0, t1));
+			rt.checksum += best;
+			if (match == winners[i])
+				same++;
+			if (match == queries[i].source)
+				rt.correct++;
+		}
+		printf("retrieval of the %d nearest by embedding:\n", o.retrieval_k);
+		report("recognition:", rt, queries.size());
+		printf("                recall %.1f%% against the exhaustive pass\n", 100.0 * same / queries.size());
+	}
+
+	if (o.coarse_margin > 0.0) {
+		std::vector<stroke_t *> coarse_strokes;
+		for (size_t j = 0; j < strokes.size(); j++)
+			coarse_strokes.push_back(make_coarse(strokes[j]));
+		Stats ct;
+		int same = 0;
+		unsigned long kept = 0;
+		for (size_t i = 0; i < queries.size(); i++) {
+			double best;
+			stroke_t *q = make_coarse(query_strokes[i]);
+			t0 = Clock::now();
+			std::vector<int> cands = coarse(ctx, q, bucket(queries[i], db), coarse_strokes, o.coarse_margin);
+			int match = recognize(ctx, query_strokes[i], cands, strokes, ct, best);
+			t1 = Clock::now();
+			stroke_free(q);
+			kept += cands.size();
+			ct.latency.push_back(elapsed_ns(t0, t1));
+			ct.checksum += best;
+			if (match == winners[i])
+				same++;
+			if (match == queries[i].source)
+				ct.correct++;
+		}
+		printf("coarse pass at 16 points with margin %.2f:\n", o.coarse_margin);
+		report("recognition:", ct, queries.size());
+		printf("                %.1f candidates kept per query, same winner as the exhaustive pass for %.1f%%\n",
+				(double)kept / queries.size(), 100.0 * same / queries.size());
+		for (size_t j = 0; j < coarse_strokes.size(); j++)
+			stroke_free(coarse_strokes[j]);
+	}
+
+	if (o.compact) {
+		std::vector<stroke_t *> compact_strokes;
+		for (size_t j = 0; j < db.size(); j++) {
+			compact_strokes.push_back(make_stroke(db[j], o.resample));
+			stroke_compact(compact_strokes.back());
+		}
+		Stats zt;
+		int same = 0;
+		for (size_t i = 0; i < queries.size(); i++) {
+			double best;
+			t0 = Clock::now();
+			int match = recognize(ctx, query_strokes[i], bucket(queries[i], db), compact_strokes, zt, best);
+			t1 = Clock::now();
+			zt.latency.push_back(elapsed_ns(t0, t1));
+			zt.checksum += best;
+			if (match == winners[i])
+				same++;
+			if (match == queries[i].source)
+				zt.correct++;
+		}
+		printf("compact database strokes:\n");
+		report("recognition:", zt, queries.size());
+		printf("                same winner as with full precision for %.1f%%\n", 100.0 * same / queries.size());
+		for (size_t j = 0; j < compact_strokes.size(); j++)
+			stroke_free(compact_strokes[j]);
+	}
+
+	// Anytime recognition visits the candidates in the order of their
+	// embeddings, as handle() does when a budget is set
+	if (o.budget > 0) {
+		Stats bt;
+		int same = 0;
+		for (size_t i = 0; i < queries.size(); i++) {
+			double best;
+			t0 = Clock::now();
+			std::vector<int> cands = bucket(queries[i], db);
+			std::vector<std::pair<float, int> > keys;
+			const float *e = stroke_get_embedding(query_strokes[i]);
+			for (size_t k = 0; k < cands.size(); k++) {
+				const float *f = stroke_get_embedding(strokes[cands[k]]);
+				float dot = 0.0f;
+				for (int d = 0; d < STROKE_EMBEDDING_SIZE; d++)
+					dot += e[d] * f[d];
+				keys.push_back(std::make_pair(-dot, cands[k]));
+			}
+			std::stable_sort(keys.begin(), keys.end());
+			for (size_t k = 0; k < keys.size(); k++)
+				cands[k] = keys[k].second;
+			int match = recognize(ctx, query_strokes[i], cands, strokes, bt, best,
+					t0 + std::chrono::microseconds(o.budget));
+			t1 = Clock::now();
+			bt.latency.push_back(elapsed_ns(t0, t1));
+			bt.checksum += best;
+			if (match == winners[i])
+				same++;
+			if (match == queries[i].source)
+				bt.correct++;
+		}
+		printf("budget of %d us:\n", o.budget);
+		report("recognition:", bt, queries.size());
+		printf("                same winner as the exhaustive pass for %.1f%%\n", 100.0 * same / queries.size());
+	}
+
+	if (o.directions) {
+		Stats et;
+		int same = 0;
+		for (size_t i = 0; i < queries.size(); i++) {
+			double best;
+			t0 = Clock::now();
+			int match = recognize_directions(query_strokes[i], bucket(queries[i], db), strokes, et, best);
+			t1 = Clock::now();
+			et.latency.push_back(elapsed_ns(t0, t1));
+			et.checksum += best;
+			if (match == winners[i])
+				same++;
+			if (match == queries[i].source)
+				et.correct++;
+		}
+		printf("directions engine:\n");
+		report("recognition:", et, queries.size());
+		printf("                same winner as the DTW engine for %.1f%%\n", 100.0 * same / queries.size());
+	}
+
+	// The same strokes, once behind shared references and once through
+	// plain pointers.  Every thread works on the same query at the same
+	// time, so with references they all keep updating its count.
+	if (o.threads > 0) {
+		std::vector<HandleCandidate> handles;
+		std::vector<ViewCandidate> views;
+		for (size_t j = 0; j < strokes.size(); j++) {
+			HandleCandidate h = { (int)j, boost::shared_ptr<stroke_t>(strokes[j], [](stroke_t *) {}) };
+			handles.push_back(h);
+			ViewCandidate v = { (int)j, strokes[j] };
+			views.push_back(v);
+		}
+		std::vector<boost::shared_ptr<stroke_t> > query_handles;
+		for (size_t i = 0; i < query_strokes.size(); i++)
+			query_handles.push_back(boost::shared_ptr<stroke_t>(query_strokes[i], [](stroke_t *) {}));
+		std::vector<std::vector<int> > buckets;
+		for (size_t i = 0; i < queries.size(); i++)
+			buckets.push_back(bucket(queries[i], db));
+		// Best of three, alternating, so that neither gets a warm start
+		double handle_sum, view_sum;
+		double handle_ns = 0.0, view_ns = 0.0;
+		for (int round = 0; round < 3; round++) {
+			double h = score_shared(query_handles, buckets, handles, o.threads, compare_handles, handle_sum);
+			double v = score_shared(query_strokes, buckets, views, o.threads, compare_views, view_sum);
+			handle_ns = round ? std::min(handle_ns, h) : h;
+			view_ns = round ? std::min(view_ns, v) : v;
+		}
+		printf("%d threads sharing each query:\n", o.threads);
+		printf("  references:   %10.1f ns/candidate (checksum %.6f)\n", handle_ns, handle_sum);
+		printf("  pointers:     %10.1f ns/candidate (checksum %.6f), %.2fx\n", view_ns, view_sum, handle_ns / view_ns);
+	}
+
+	stroke_compare_ctx_free(ctx);
+	for (size_t j = 0; j < strokes.size(); j++)
+		stroke_free(strokes[j]);
+	for (size_t i = 0; i < query_strokes.size(); i++)
+		stroke_free(query_strokes[i]);
+	return EXIT_SUCCESS;
+}
@@ -20,6 +20,8 @@
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/export.hpp>
+#include <atomic>
+#include <vector>
 
 BOOST_CLASS_EXPORT(Stroke)
 
@@ -40,33 +42,124 @@ Stroke::Stroke(PreStroke &ps, int trigger_, int button_, unsigned int modifiers_
 		stroke_t *s = stroke_alloc(ps.size());
 		for (std::vector<RTriple>::iterator i = ps.begin(); i != ps.end(); ++i)
 			stroke_add_point(s, (*i)->x, (*i)->y);
+		set_stroke(s);
+	}
+}
+
+// Used both for new strokes and for strokes loaded from disk, so that the
+// database gets migrated to the configured number of points.  Resampling
+// isn't idempotent, so strokes that already have been resampled are left
+// alone; otherwise they would drift a bit with every save.
+void Stroke::finish(stroke_t *s, bool resampled) {
+	int n = prefs.resample_points.get();
+	if (n >= 2 && !resampled)
+		stroke_finish_resampled(s, n);
+	else
 		stroke_finish(s);
-		stroke.reset(s, &stroke_free);
+}
+
+// The size at which the specialized comparison in stroke.c is the fastest
+static const int coarse_points = 16;
+
+void Stroke::set_stroke(stroke_t *s, bool resampled) {
+	finish(s, resampled);
+	stroke.reset(s, &stroke_free);
+}
+
+// The coarse pass is off by default, so the copies are only made once it
+// runs.  That is after compact() for strokes from the database, so the copy
+// is compacted here if the stroke is.  Not thread-safe: coarse_filter()
+// calls this before it hands the comparisons to the worker pool.
+void Stroke::make_coarse() const {
+	if (coarse || !stroke)
+		return;
+	const stroke_t *s = stroke.get();
+	if (stroke_get_size(s) <= coarse_points) {
+		coarse = stroke;
+		return;
+	}
+	stroke_t *c = stroke_alloc(stroke_get_size(s));
+	for (int i = 0; i < stroke_get_size(s); i++) {
+		double x, y;
+		stroke_get_point(s, i, &x, &y);
+		stroke_add_point(c, x, y);
 	}
+	stroke_finish_resampled(c, coarse_points);
+	if (stroke_is_compact(s))
+		stroke_compact(c);
+	coarse.reset(c, &stroke_free);
+}
+
+// Lower bounds on the comparison cost, cheapest first.  Each of them is
+// computed from data that stroke_finish() stores with the stroke.
+struct Prefilter {
+	const char *name;
+	double (*bound)(const stroke_t *, const stroke_t *);
+	std::atomic<unsigned long> rejected;
+};
+
+static Prefilter prefilters[] = {
+	{ "endpoints", &stroke_bound_endpoints, {0} },
+	{ "histogram", &stroke_bound_histogram, {0} },
+};
+
+static std::atomic<unsigned long> prefilter_passed(0);
+
+static bool prefilter(const stroke_t *a, const stroke_t *b, double cutoff, bool count) {
+	for (unsigned int i = 0; i < sizeof(prefilters)/sizeof(*prefilters); i++)
+		if (prefilters[i].bound(a, b) >= cutoff) {
+			if (count)
+				prefilters[i].rejected++;
+			return false;
+		}
+	if (count)
+		prefilter_passed++;
+	return true;
+}
+
+void Stroke::log_prefilter_stats() {
+	for (unsigned int i = 0; i < sizeof(prefilters)/sizeof(*prefilters); i++)
+		g_debug("Prefilter %s rejected %lu candidates\n", prefilters[i].name, prefilters[i].rejected.load());
+	g_debug("%lu candidates passed all prefilters\n", prefilter_passed.load());
+}
+
+double Stroke::cutoff(double min_score) {
+	return MIN((1.0 - min_score)/2.5, stroke_infinity);
 }
 
-int Stroke::compare(RStroke a, RStroke b, double &score) {
+// Everything compare() decides without running the DP.  Returns true if the
+// DP is needed, otherwise the result is in match and score.  The prefilters
+// only run if bounded is set, and only count towards log_prefilter_stats()
+// if count is.
+static bool precheck(const Stroke *a, const Stroke *b, double cutoff, int &match, double &score, bool bounded = true,
+		bool count = false) {
 	score = 0.0;
+	match = -1;
 	if (!a || !b)
-		return -1;
+		return false;
 	if (!a->timeout != !b->timeout)
-		return -1;
+		return false;
 	if (a->button != b->button)
-		return -1;
+		return false;
 	if (a->trigger != b->trigger)
-		return -1;
+		return false;
 	if (a->modifiers != b->modifiers)
-		return -1;
+		return false;
 	if (!a->stroke || !b->stroke) {
 		if (!a->stroke && !b->stroke) {
 			score = 1.0;
-			return 1;
+			match = 1;
 		}
-		return -1;
+		return false;
 	}
-	double cost = stroke_compare(a->stroke.get(), b->stroke.get(), nullptr, nullptr);
+	return !bounded || prefilter(a->stroke.get(), b->stroke.get(), cutoff, count);
+}
+
+static int accept(const Stroke *a, double cost, double &score, double *cost_) {
 	if (cost >= stroke_infinity)
 		return -1;
+	if (cost_)
+		*cost_ = cost;
 	score = MAX(1.0 - 2.5*cost, 0.0);
 	if (a->timeout)
 		return score > 0.85;
@@ -74,6 +167,74 @@ int Stroke::compare(RStroke a, RStroke b, double &score) {
 		return score > 0.7;
 }
 
+// Candidates that can't score better than min_score are rejected early.  If
+// the result depends on min_score, the underlying cost is stored in *cost so
+// that callers can tell whether the match holds up against a higher
+// min_score; otherwise *cost is set to -1.  rec defaults to the DTW engine.
+// The matcher calls this once per candidate from several threads, so it
+// takes plain pointers: copying an RStroke would touch its shared reference
+// count each time.  Only recognition sets count, so that the prefilter
+// statistics aren't mixed up with those of the prototypes or the matrix.
+int Stroke::compare(const Stroke *a, const Stroke *b, double &score, double min_score, stroke_compare_ctx_t *ctx,
+		double *cost_, const Recognizer *rec, bool count) {
+	if (cost_)
+		*cost_ = -1.0;
+	if (!rec)
+		rec = Recognizer::dtw();
+	double cutoff = Stroke::cutoff(min_score);
+	int match;
+	if (!precheck(a, b, cutoff, match, score, rec->bounded(), count))
+		return match;
+	double cost = rec->cost(ctx, a->stroke.get(), b->stroke.get(), cutoff);
+	return accept(a, cost, score, cost_);
+}
+
+// Only for strokes in the database: input strokes are compared far more
+// often than they would take up space.
+void Stroke::compact() {
+	if (stroke)
+		stroke_compact(stroke.get());
+}
+
+// Like compare() with min_score 0, but on the coarse copies of the strokes,
+// which make_coarse() has to have made.  The prefilters are skipped: they
+// hold for the full strokes, and cutoff 0 lets almost everything through.
+// The score only approximates that of compare().
+int Stroke::compare_coarse(const Stroke *a, const Stroke *b, double &score, stroke_compare_ctx_t *ctx) {
+	double cutoff = Stroke::cutoff(0.0);
+	int match;
+	if (!precheck(a, b, cutoff, match, score, false))
+		return match;
+	double cost = ctx ?
+		stroke_compare_with(ctx, a->coarse.get(), b->coarse.get(), nullptr, nullptr, cutoff) :
+		stroke_compare_bounded(a->coarse.get(), b->coarse.get(), nullptr, nullptr, cutoff);
+	return accept(a, cost, score, nullptr);
+}
+
+// Like compare() with the DTW engine, against a batch of strokes that all
+// get the same min_score.  match, score and cost (if given) receive one entry per stroke.
+void Stroke::compare_many(const Stroke *a, const Stroke *const *bs, int n, double min_score,
+		stroke_compare_ctx_t *ctx, int *match, double *score, double *cost) {
+	double cutoff = Stroke::cutoff(min_score);
+	std::vector<const stroke_t *> dp(n, nullptr);
+	std::vector<double> costs(n);
+	for (int k = 0; k < n; k++) {
+		if (cost)
+			cost[k] = -1.0;
+		if (precheck(a, bs[k], cutoff, match[k], score[k]))
+			dp[k] = bs[k]->stroke.get();
+	}
+	if (!a || !a->stroke)
+		return;
+	if (ctx)
+		stroke_compare_many_with(ctx, a->stroke.get(), dp.data(), n, cutoff, costs.data());
+	else
+		stroke_compare_many(a->stroke.get(), dp.data(), n, cutoff, costs.data());
+	for (int k = 0; k < n; k++)
+		if (dp[k])
+			match[k] = accept(a, costs[k], score[k], cost ? cost + k : nullptr);
+}
+
 Glib::RefPtr<Gdk::Pixbuf> Stroke::draw(int size, double width, bool inv) const {
 	if (size != STROKE_SIZE || (width != 2.0 && width != 4.0) || inv)
 		return draw_(size, width, inv);
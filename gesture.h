@@ -17,6 +17,7 @@
 #define __GESTURE_H__
 
 #include "stroke.h"
+#include "recognizer.h"
 #include <gdkmm.h>
 #include <vector>
 #include <boost/shared_ptr.hpp>
@@ -77,6 +78,9 @@ public:
 
 private:
 	Stroke(PreStroke &s, int trigger_, int button_, unsigned int modifiers_, bool timeout_);
+	static void finish(stroke_t *s, bool resampled);
+	void set_stroke(stroke_t *s, bool resampled = false);
+	void compact();
 
 	Glib::RefPtr<Gdk::Pixbuf> draw_(int size, double width = 2.0, bool inv = false) const;
 	mutable Glib::RefPtr<Gdk::Pixbuf> pb[2];
@@ -93,6 +97,9 @@ public:
 	unsigned int modifiers;
 	bool timeout;
 	boost::shared_ptr<stroke_t> stroke;
+	// A copy of stroke at low resolution for the first pass of
+	// coarse_filter().  Only there after make_coarse() has been called.
+	mutable boost::shared_ptr<stroke_t> coarse;
 
 	Stroke() : trigger(0), button(0), modifiers(AnyModifier), timeout(false) {}
 	static RStroke create(PreStroke &s, int trigger_, int button_, unsigned int modifiers_, bool timeout_) {
@@ -104,7 +111,20 @@ public:
 	bool show_icon();
 
 	static RStroke trefoil();
-	static int compare(RStroke, RStroke, double &);
+	static double cutoff(double min_score);
+	static int compare(const Stroke *, const Stroke *, double &, double min_score = 0.0,
+			stroke_compare_ctx_t *ctx = nullptr, double *cost = nullptr, const Recognizer *rec = nullptr,
+			bool count = false);
+	static int compare(const RStroke &a, const RStroke &b, double &score, double min_score = 0.0,
+			stroke_compare_ctx_t *ctx = nullptr, double *cost = nullptr, const Recognizer *rec = nullptr) {
+		return compare(a.get(), b.get(), score, min_score, ctx, cost, rec);
+	}
+	void make_coarse() const;
+	static int compare_coarse(const Stroke *, const Stroke *, double &, stroke_compare_ctx_t *ctx = nullptr);
+	static void compare_many(const Stroke *a, const Stroke *const *bs, int n, double min_score,
+			stroke_compare_ctx_t *ctx, int *match, double *score, double *cost = nullptr);
+	// How many candidates each prefilter rejected during recognition
+	static void log_prefilter_stats();
 	static Glib::RefPtr<Gdk::Pixbuf> drawEmpty(int);
 	static Glib::RefPtr<Gdk::Pixbuf> drawDebug(RStroke, RStroke, int);
 
@@ -144,8 +164,10 @@ template<class Archive> void Stroke::load(Archive & ar, const unsigned int versi
         stroke_t *s = stroke_alloc(ps.size());
         for (std::vector<Point>::iterator i = ps.begin(); i != ps.end(); ++i)
             stroke_add_point(s, i->x, i->y);
-        stroke_finish(s);
-        stroke.reset(s, &stroke_free);
+        // Strokes are saved after resampling, so only migrate them once
+        set_stroke(s, (int)ps.size() == prefs.resample_points.get());
+        if (prefs.compact_strokes.get())
+            compact();
     }
     if (version == 0) return;
     ar & boost::serialization::make_nvp("button", button);
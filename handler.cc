@@ -864,6 +864,9 @@ class StrokeHandler : public Handler, public sigc::trackable {
 	guint button;
 	guint trigger;
 	RPreStroke cur;
+	// Every motion event, for the trace and for replaying the stroke.  The
+	// same as cur unless the device has decimation set.
+	RPreStroke events;
 	bool is_gesture;
 	bool drawing;
 	RTriple last, orig;
@@ -880,8 +883,59 @@ class StrokeHandler : public Handler, public sigc::trackable {
 	typedef boost::shared_ptr<Connection> RConnection;
 	sigc::connection init_connection;
 	std::vector<RConnection> connections;
+	// Matching against the part of the stroke drawn so far, redone whenever
+	// the stroke has grown by a quarter
+	Prematch prematch;
+	size_t prematch_size;
+	sigc::connection prematch_connection;
+
+	bool update_prematch() {
+		prematch_size = cur->size();
+		const ActionListDiff *list = actions.get_action_list(grabber->current_class->get());
+		Stroke key;
+		key.trigger = trigger;
+		key.modifiers = xstate->modifiers;
+		if (!list->worth_prematching(key))
+			return false;
+		RStroke s = Stroke::create(*cur, trigger, 0, xstate->modifiers, false);
+		list->prematch(s, prematch);
+		return false;
+	}
+
+	Decimation decimation;
+	RTriple skipped;
+
+	// Adds e to the stroke unless it is too close to the last point
+	void add_point(RTriple e) {
+		if (decimation.step <= 0)
+			return cur->add(e);
+		events->add(e);
+		RTriple p = cur->back();
+		if (hypot(e->x - p->x, e->y - p->y) < decimation.step) {
+			skipped = e;
+			return;
+		}
+		if (skipped && decimation.keep_turns) {
+			double dx1 = skipped->x - p->x, dy1 = skipped->y - p->y;
+			double dx2 = e->x - skipped->x, dy2 = e->y - skipped->y;
+			// A turn of more than 45 degrees
+			if (dx1*dx2 + dy1*dy2 < M_SQRT1_2 * hypot(dx1, dy1) * hypot(dx2, dy2))
+				cur->add(skipped);
+		}
+		skipped.reset();
+		cur->add(e);
+	}
+
+	// The stroke always ends at the last motion event
+	void flush_points() {
+		if (skipped)
+			cur->add(skipped);
+		skipped.reset();
+	}
 
 	RStroke finish(guint b) {
+		prematch_connection.disconnect();
+		flush_points();
 		trace->end();
 		XFlush(dpy);
 		RPreStroke c = cur;
@@ -892,6 +946,7 @@ class StrokeHandler : public Handler, public sigc::trackable {
 
 	bool timeout() {
         g_debug("Aborting stroke...");
+		flush_points();
 		trace->end();
 		RPreStroke c = cur;
 		if (!is_gesture)
@@ -899,7 +954,7 @@ class StrokeHandler : public Handler, public sigc::trackable {
 		RStroke s;
 		if (prefs.timeout_gestures.get() || grabber->is_click_hold(button))
 			s = Stroke::create(*c, trigger, 0, xstate->modifiers, true);
-		parent->replace_child(AdvancedHandler::create(s, last, button, 0, cur));
+		parent->replace_child(AdvancedHandler::create(s, last, button, 0, events));
 		XFlush(dpy);
 		return false;
 	}
@@ -907,7 +962,7 @@ class StrokeHandler : public Handler, public sigc::trackable {
 	void do_instant() {
 		PreStroke ps;
 		RStroke s = Stroke::create(ps, trigger, button, xstate->modifiers, false);
-		parent->replace_child(AdvancedHandler::create(s, orig, button, button, cur));
+		parent->replace_child(AdvancedHandler::create(s, orig, button, button, events));
 	}
 
 	bool expired(RConnection c, double dist) {
@@ -916,10 +971,11 @@ class StrokeHandler : public Handler, public sigc::trackable {
 	}
 protected:
 	void abort_stroke() {
-		parent->replace_child(AdvancedHandler::create(RStroke(), last, button, 0, cur));
+		flush_points();
+		parent->replace_child(AdvancedHandler::create(RStroke(), last, button, 0, events));
 	}
 	virtual void motion(RTriple e) {
-		cur->add(e);
+		add_point(e);
 		float dist = hypot(e->x-orig->x, e->y-orig->y);
 		if (!is_gesture && dist > 16) {
 			if (use_timeout && !final_timeout)
@@ -930,7 +986,7 @@ protected:
 		if (!drawing && dist > 4 && (!use_timeout || final_timeout)) {
 			drawing = true;
 			bool first = true;
-			for (PreStroke::iterator i = cur->begin(); i != cur->end(); i++) {
+			for (PreStroke::iterator i = events->begin(); i != events->end(); i++) {
 				Trace::Point p;
 				p.x = (*i)->x;
 				p.y = (*i)->y;
@@ -947,6 +1003,9 @@ protected:
 			p.y = e->y;
 			trace->draw(p);
 		}
+		if (prefs.prematch.get() && is_gesture && !stroke_action && !prematch_connection.connected() &&
+				cur->size() >= prematch_size + prematch_size/4 + 8)
+			prematch_connection = Glib::signal_idle().connect(sigc::mem_fun(*this, &StrokeHandler::update_prematch));
 		if (use_timeout && is_gesture) {
 			connections.erase(remove_if(connections.begin(), connections.end(),
 						sigc::bind(sigc::mem_fun(*this, &StrokeHandler::expired),
@@ -958,7 +1017,7 @@ protected:
 
 	virtual void press(guint b, RTriple e) {
 		RStroke s = finish(b);
-		parent->replace_child(AdvancedHandler::create(s, e, button, b, cur));
+		parent->replace_child(AdvancedHandler::create(s, e, button, b, events));
 	}
 
 	virtual void release(guint b, RTriple e) {
@@ -974,7 +1033,7 @@ protected:
 			return parent->replace_child(nullptr);
 		}
 		RRanking ranking;
-		RAction act = actions.get_action_list(grabber->current_class->get())->handle(s, ranking);
+		RAction act = actions.get_action_list(grabber->current_class->get())->handle(s, ranking, &prematch);
 		if (!IS_CLICK(act))
 			Ranking::queue_show(ranking, e);
 		if (!act) {
@@ -1016,7 +1075,8 @@ public:
 		orig(e),
 		init_timeout(prefs.init_timeout.get()),
 		final_timeout(prefs.final_timeout.get()),
-		radius(16)
+		radius(16),
+		prematch_size(0)
 	{
 		const std::map<std::string, TimeoutType> &dt = prefs.device_timeout.ref();
 		std::map<std::string, TimeoutType>::const_iterator j = dt.find(xstate->current_dev->name);
@@ -1025,6 +1085,10 @@ public:
 		else
 			get_timeouts(prefs.timeout_profile.get(), &init_timeout, &final_timeout);
 		use_timeout = init_timeout;
+		const std::map<std::string, Decimation> &dd = prefs.device_decimation.ref();
+		std::map<std::string, Decimation>::const_iterator k = dd.find(xstate->current_dev->name);
+		if (k != dd.end())
+			decimation = k->second;
 	}
 	virtual void init() {
 		if (grabber->is_instant(button))
@@ -1036,6 +1100,11 @@ public:
 		}
 		cur = PreStroke::create();
 		cur->add(orig);
+		events = cur;
+		if (decimation.step > 0) {
+			events = PreStroke::create();
+			events->add(orig);
+		}
 		if (!use_timeout)
 			return;
 		if (final_timeout && final_timeout < 32 && radius < 16*32/final_timeout) {
@@ -412,7 +412,8 @@ App::~App() {
 		delete grabber;
 		XCloseDisplay(dpy);
 		prefs.execute_now();
-		action_watcher->execute_now();
+		action_watcher->flush();
+		Stroke::log_prefilter_stats();
 	}
 }
 
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2008-2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "matcher.h"
+#include "prefdb.h"
+
+#include <map>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// A fixed set of threads, each with its own comparison context.  run() hands
+// every thread its index and waits until all of them are done.  Jobs from
+// different threads take turns.
+class WorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex run_mutex;
+	std::mutex mutex;
+	std::condition_variable work_cond;
+	std::condition_variable done_cond;
+	std::function<void(int, stroke_compare_ctx_t *)> job;
+	unsigned int generation;
+	int busy;
+	bool quit;
+
+	void work(int i) {
+		stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+		unsigned int seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			work_cond.wait(lock, [&]{ return quit || generation != seen; });
+			if (quit)
+				break;
+			seen = generation;
+			lock.unlock();
+			job(i, ctx);
+			lock.lock();
+			if (!--busy)
+				done_cond.notify_one();
+		}
+		stroke_compare_ctx_free(ctx);
+	}
+public:
+	WorkerPool(int n) : generation(0), busy(0), quit(false) {
+		for (int i = 0; i < n; i++)
+			threads.push_back(std::thread(&WorkerPool::work, this, i));
+	}
+	int size() const { return threads.size(); }
+	void run(std::function<void(int, stroke_compare_ctx_t *)> f) {
+		std::lock_guard<std::mutex> turn(run_mutex);
+		std::unique_lock<std::mutex> lock(mutex);
+		job = f;
+		busy = threads.size();
+		generation++;
+		work_cond.notify_all();
+		done_cond.wait(lock, [&]{ return !busy; });
+	}
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		work_cond.notify_all();
+		for (std::vector<std::thread>::iterator i = threads.begin(); i != threads.end(); i++)
+			i->join();
+	}
+};
+
+static boost::shared_ptr<WorkerPool> get_pool() {
+	static boost::shared_ptr<WorkerPool> pool;
+	static std::mutex pool_mutex;
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	int n = prefs.match_threads.get();
+	if (n <= 1)
+		pool.reset();
+	else if (!pool || pool->size() != n)
+		pool.reset(new WorkerPool(n));
+	return pool;
+}
+
+// Scratch space for comparisons that run on the main thread
+static stroke_compare_ctx_t *main_ctx() {
+	static stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+	return ctx;
+}
+
+// Scores candidates begin, begin + step, ... until the deadline has passed.
+// Returns false if it has.
+static bool score_range(const Stroke *s, bool per_button, const Recognizer *rec, const std::vector<Candidate> &cands,
+		std::vector<Score> &scores, size_t begin, size_t step, stroke_compare_ctx_t *ctx, Deadline deadline,
+		double slack) {
+	std::map<guint, double> best;
+	Stroke t;
+	if (per_button && begin < cands.size()) {
+		t = *s;
+		s = &t;
+	}
+	bool timed = deadline != Deadline::max();
+	for (size_t i = begin; i < cands.size(); i += step) {
+		if (timed && std::chrono::steady_clock::now() > deadline)
+			return false;
+		const Candidate &c = cands[i];
+		if (per_button)
+			t.button = c.stroke->button;
+		double &group_best = best.insert(std::make_pair(c.group, 0.0)).first->second;
+		Score &sc = scores[i];
+		sc.match = Stroke::compare(s, c.stroke, sc.score, MAX(group_best - slack, 0.0), ctx, &sc.cost, rec, true);
+		if (sc.match >= 0 && sc.score > group_best)
+			group_best = sc.score;
+	}
+	return true;
+}
+
+// Worker i gets candidates i, i + k, i + 2k, ..., so that every worker
+// starts out with some of the most promising ones.  The candidates that
+// precede a given one in its share are a subset of all the candidates that
+// precede it, so its min_score is never higher than in a serial pass.
+bool score_candidates(const Stroke *s, bool per_button, const Recognizer *rec, const std::vector<Candidate> &cands,
+		std::vector<Score> &scores, Deadline deadline, double slack) {
+	Score none = { -1, 0.0, -1.0 };
+	scores.assign(cands.size(), none);
+	boost::shared_ptr<WorkerPool> pool = get_pool();
+	if (!pool || cands.size() < 2 * (size_t)pool->size())
+		return score_range(s, per_button, rec, cands, scores, 0, 1, main_ctx(), deadline, slack);
+	size_t k = pool->size();
+	std::atomic<bool> complete(true);
+	pool->run([&](int i, stroke_compare_ctx_t *ctx) {
+		if (!score_range(s, per_button, rec, cands, scores, i, k, ctx, deadline, slack))
+			complete = false;
+	});
+	return complete;
+}
+
+// A prototype that was rejected had a score below the best one before it
+// less margin, so it can't be within margin of the best one in the end.
+bool score_condensed(const Stroke *s, bool per_button, const Recognizer *rec, const std::set<const Stroke *> &extras,
+		double margin, boost::shared_ptr<std::vector<Candidate> > &cands, std::vector<Score> &scores,
+		Deadline deadline) {
+	boost::shared_ptr<std::vector<Candidate> > scored(new std::vector<Candidate>);
+	std::vector<Candidate> rest;
+	for (std::vector<Candidate>::const_iterator i = cands->begin(); i != cands->end(); i++)
+		if (extras.count(i->stroke))
+			rest.push_back(*i);
+		else
+			scored->push_back(*i);
+	if (rest.empty())
+		return score_candidates(s, per_button, rec, *cands, scores, deadline);
+	bool complete = score_candidates(s, per_button, rec, *scored, scores, deadline, margin);
+	std::map<guint, double> best;
+	std::map<std::pair<guint, Unique *>, double> action_best;
+	for (size_t k = 0; k < scored->size(); k++) {
+		if (scores[k].match < 0)
+			continue;
+		const Candidate &c = (*scored)[k];
+		double &b = best[c.group];
+		b = MAX(b, scores[k].score);
+		double &a = action_best[std::make_pair(c.group, c.id)];
+		a = MAX(a, scores[k].score);
+	}
+	std::vector<Candidate> expanded;
+	for (std::vector<Candidate>::const_iterator i = rest.begin(); i != rest.end(); i++) {
+		std::map<std::pair<guint, Unique *>, double>::const_iterator a = action_best.find(std::make_pair(i->group, i->id));
+		if (a != action_best.end() && a->second >= best[i->group] - margin)
+			expanded.push_back(*i);
+	}
+	std::vector<Score> more;
+	if (!score_candidates(s, per_button, rec, expanded, more, deadline))
+		complete = false;
+	scored->insert(scored->end(), expanded.begin(), expanded.end());
+	scores.insert(scores.end(), more.begin(), more.end());
+	cands = scored;
+	return complete;
+}
+
+// Greedily adds the example that brings the total distance of all examples
+// to their nearest prototype down the most, as k-medoids does for its
+// initial guess.  The distance of two examples is one minus their score.
+static std::vector<size_t> medoids(const std::vector<const Stroke *> &examples, size_t k, const Recognizer *rec,
+		stroke_compare_ctx_t *ctx, const std::atomic<bool> &cancel) {
+	size_t m = examples.size();
+	std::vector<size_t> chosen;
+	if (m <= k) {
+		for (size_t i = 0; i < m; i++)
+			chosen.push_back(i);
+		return chosen;
+	}
+	std::vector<double> dist(m * m, 0.0);
+	for (size_t i = 0; i < m; i++) {
+		if (cancel)
+			return chosen;
+		for (size_t j = i + 1; j < m; j++) {
+			double score;
+			Stroke::compare(examples[i], examples[j], score, 0.0, ctx, nullptr, rec);
+			dist[i*m+j] = dist[j*m+i] = 1.0 - score;
+		}
+	}
+	std::vector<double> nearest(m, 1.0);
+	std::vector<bool> taken(m, false);
+	while (chosen.size() < k) {
+		size_t best = m;
+		double best_gain = -1.0;
+		for (size_t i = 0; i < m; i++) {
+			if (taken[i])
+				continue;
+			double gain = 0.0;
+			for (size_t j = 0; j < m; j++)
+				gain += MAX(nearest[j] - dist[i*m+j], 0.0);
+			if (gain > best_gain) {
+				best_gain = gain;
+				best = i;
+			}
+		}
+		taken[best] = true;
+		chosen.push_back(best);
+		for (size_t j = 0; j < m; j++)
+			nearest[j] = MIN(nearest[j], dist[best*m+j]);
+	}
+	std::sort(chosen.begin(), chosen.end());
+	return chosen;
+}
+
+bool find_prototypes(const std::vector<std::vector<const Stroke *> > &groups, size_t k, const Recognizer *rec,
+		stroke_compare_ctx_t *ctx, const std::atomic<bool> &cancel, std::vector<std::vector<size_t> > &prototypes) {
+	prototypes.resize(groups.size());
+	for (size_t i = 0; i < groups.size(); i++) {
+		prototypes[i] = medoids(groups[i], k, rec, ctx, cancel);
+		if (cancel)
+			return false;
+	}
+	return true;
+}
+
+boost::shared_ptr<std::vector<Candidate> > retrieve(const Stroke *s, boost::shared_ptr<std::vector<Candidate> > cands,
+		const std::vector<float> &embeddings, int k) {
+	if (!s->stroke || cands->size() <= (size_t)k)
+		return cands;
+	std::vector<int> nearest(k);
+	k = stroke_nearest(stroke_get_embedding(s->stroke.get()), embeddings.data(), cands->size(), k, nearest.data());
+	boost::shared_ptr<std::vector<Candidate> > result(new std::vector<Candidate>);
+	result->reserve(k);
+	for (int i = 0; i < k; i++)
+		result->push_back((*cands)[nearest[i]]);
+	return result;
+}
+
+boost::shared_ptr<std::vector<Candidate> > coarse_filter(const Stroke *s, bool per_button,
+		boost::shared_ptr<std::vector<Candidate> > cands, double margin, Deadline deadline) {
+	if (cands->size() < 2)
+		return cands;
+	s->make_coarse();
+	for (size_t i = 0; i < cands->size(); i++)
+		(*cands)[i].stroke->make_coarse();
+	// Candidates that weren't reached keep -1 and pass
+	std::vector<double> scores(cands->size(), -1.0);
+	bool timed = deadline != Deadline::max();
+	run_parallel(cands->size(), main_ctx(), [&](size_t begin, size_t end, stroke_compare_ctx_t *ctx) {
+		Stroke t;
+		const Stroke *a = s;
+		if (per_button && begin < end) {
+			t = *s;
+			a = &t;
+		}
+		for (size_t i = begin; i < end; i++) {
+			if (timed && std::chrono::steady_clock::now() > deadline)
+				return;
+			if (per_button)
+				t.button = (*cands)[i].stroke->button;
+			Stroke::compare_coarse(a, (*cands)[i].stroke, scores[i], ctx);
+		}
+	});
+	std::map<guint, double> best;
+	for (size_t i = 0; i < cands->size(); i++) {
+		double &b = best.insert(std::make_pair((*cands)[i].group, 0.0)).first->second;
+		if (scores[i] > b)
+			b = scores[i];
+	}
+	boost::shared_ptr<std::vector<Candidate> > result(new std::vector<Candidate>);
+	for (size_t i = 0; i < cands->size(); i++)
+		if (scores[i] < 0.0 || scores[i] >= best[(*cands)[i].group] - margin)
+			result->push_back((*cands)[i]);
+	return result;
+}
+
+void run_parallel(size_t n, stroke_compare_ctx_t *ctx, std::function<void(size_t, size_t, stroke_compare_ctx_t *)> f) {
+	boost::shared_ptr<WorkerPool> pool = get_pool();
+	if (!pool || n < 2 * (size_t)pool->size())
+		return f(0, n, ctx);
+	size_t k = pool->size();
+	pool->run([&](int i, stroke_compare_ctx_t *ctx) {
+		f(n*i/k, n*(i+1)/k, ctx);
+	});
+}
+
+CompareCache::Map CompareCache::map;
+
+// Plenty for the rankings that Stats keeps around and the strokes of a
+// large database
+static const size_t compare_cache_size = 16384;
+
+CompareCache::Result &CompareCache::insert(RStroke a, RStroke b) {
+	Map::iterator i = map.find(std::make_pair(a.get(), b.get()));
+	if (i != map.end())
+		return i->second.r;
+	if (map.size() >= compare_cache_size)
+		map.clear();
+	Entry &e = map[std::make_pair(a.get(), b.get())];
+	e.a = a;
+	e.b = b;
+	e.r.match = -1;
+	e.r.score = 0.0;
+	e.r.cost = -1.0;
+	e.r.has_path = false;
+	return e.r;
+}
+
+bool CompareCache::has_room(size_t entries) {
+	return map.size() + entries <= compare_cache_size;
+}
+
+void CompareCache::store(RStroke a, RStroke b, int match, double score, double cost) {
+	Result &r = insert(a, b);
+	r.match = match;
+	r.score = score;
+	r.cost = cost;
+}
+
+const CompareCache::Result *CompareCache::find(RStroke a, RStroke b) {
+	Map::const_iterator i = map.find(std::make_pair(a.get(), b.get()));
+	return i == map.end() ? nullptr : &i->second.r;
+}
+
+const CompareCache::Result &CompareCache::get(RStroke a, RStroke b, bool path) {
+	const Result *cached = find(a, b);
+	if (!cached) {
+		double score, cost;
+		int match = Stroke::compare(a, b, score, 0.0, main_ctx(), &cost);
+		store(a, b, match, score, cost);
+	}
+	Result &r = insert(a, b);
+	if (!path || r.has_path)
+		return r;
+	r.has_path = true;
+	if (!a || !b || !a->stroke || !b->stroke)
+		return r;
+	// The cost is an upper bound on every cell of the optimal path, so
+	// using it as the cutoff leaves the path as it is but skips most of
+	// the table.
+	double cutoff = r.cost >= 0.0 ? r.cost + stroke_compare_tolerance : stroke_infinity;
+	r.path_x.resize(a->size() + b->size());
+	r.path_y.resize(a->size() + b->size());
+	stroke_compare_with(main_ctx(), a->stroke.get(), b->stroke.get(), r.path_x.data(), r.path_y.data(), cutoff);
+	return r;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2008-2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __MATCHER_H__
+#define __MATCHER_H__
+#include "gesture.h"
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <atomic>
+#include <functional>
+
+class Unique;
+
+// A stroke from the action database.  group identifies the ranking that the
+// candidate counts towards; handle_advanced keeps one per button.  The stroke
+// belongs to the index of the action list, see ActionListDiff::get_index, so
+// candidates can be copied and sorted without touching reference counts.
+struct Candidate {
+	Unique *id;
+	const Stroke *stroke;
+	guint group;
+};
+
+struct Score {
+	int match;
+	double score;
+	double cost;
+	// Would Stroke::compare have accepted the candidate with this min_score?
+	bool beats(double min_score) const {
+		return match >= 0 && (cost < 0.0 || cost < Stroke::cutoff(min_score));
+	}
+};
+
+// The k highest scores seen so far together with the index of the candidate
+// they belong to, best first
+class TopK {
+public:
+	struct Entry {
+		double score;
+		int index;
+	};
+	typedef std::vector<Entry>::const_iterator iterator;
+private:
+	std::vector<Entry> entries;
+	size_t k;
+public:
+	TopK(int k_) : k(k_ > 0 ? k_ : 0) { entries.reserve(k); }
+	void insert(double score, int index) {
+		if (entries.size() == k) {
+			if (!k || score <= entries.back().score)
+				return;
+			entries.pop_back();
+		}
+		std::vector<Entry>::iterator i = entries.begin();
+		while (i != entries.end() && i->score >= score)
+			i++;
+		Entry e = { score, index };
+		entries.insert(i, e);
+	}
+	iterator begin() const { return entries.begin(); }
+	iterator end() const { return entries.end(); }
+	size_t size() const { return entries.size(); }
+	bool empty() const { return entries.empty(); }
+};
+
+// Results of comparisons with min_score 0 and the DTW engine for the
+// debugging views, so that they can reuse what recognition has already
+// found out.  Entries hold on to
+// both strokes, so their addresses can't be taken over by other strokes.
+// Only used on the main thread; update_actions() empties the cache.
+class CompareCache {
+public:
+	struct Result {
+		int match;
+		double score;
+		double cost;
+		bool has_path;
+		std::vector<int> path_x, path_y;
+	};
+private:
+	struct Entry {
+		RStroke a, b;
+		Result r;
+	};
+	typedef std::map<std::pair<const Stroke *, const Stroke *>, Entry> Map;
+	static Map map;
+	static Result &insert(RStroke a, RStroke b);
+public:
+	// cost is -1 if it isn't known
+	static void store(RStroke a, RStroke b, int match, double score, double cost);
+	static const Result *find(RStroke a, RStroke b);
+	// Compares a and b if necessary.  If path is set, the result also holds
+	// the path that drawDebug shows, which is computed even if the strokes
+	// don't match.
+	static const Result &get(RStroke a, RStroke b, bool path = false);
+	static void clear() { map.clear(); }
+	// Whether that many new entries fit without pushing out others
+	static bool has_room(size_t entries);
+};
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// Compares s against all candidates.  Each candidate is compared with the
+// best score of its group among the candidates before it as min_score, or
+// with a lower one, so replaying the results in order with Score::beats
+// gives exactly the result of comparing them one after another.  If
+// per_button is set, s takes on the button of each candidate.  rec is
+// passed on to Stroke::compare.
+//
+// Candidates that are still left once the deadline has passed keep match
+// -1, and the result is false.  Those that come first in cands are the
+// first to be compared.  With slack, min_score is that much below the best
+// score so far.
+bool score_candidates(const Stroke *s, bool per_button, const Recognizer *rec, const std::vector<Candidate> &cands,
+		std::vector<Score> &scores, Deadline deadline = Deadline::max(), double slack = 0.0);
+
+// Like score_candidates, but the candidates whose strokes are in extras are
+// only compared if a prototype of the same action, that is, one of its
+// other strokes, has come within margin of the best score of the group.
+// cands is replaced by the candidates that have been compared, in the
+// order that scores refers to.
+bool score_condensed(const Stroke *s, bool per_button, const Recognizer *rec, const std::set<const Stroke *> &extras,
+		double margin, boost::shared_ptr<std::vector<Candidate> > &cands, std::vector<Score> &scores,
+		Deadline deadline = Deadline::max());
+
+// For each group of strokes, the indices of up to k of them that cover the
+// whole group best, in increasing order.  Runs on the calling thread, which
+// is meant to be one of its own, so that recognition keeps the worker pool.
+// Gives up and returns false soon after cancel is set.
+bool find_prototypes(const std::vector<std::vector<const Stroke *> > &groups, size_t k, const Recognizer *rec,
+		stroke_compare_ctx_t *ctx, const std::atomic<bool> &cancel, std::vector<std::vector<size_t> > &prototypes);
+
+// The k candidates whose embeddings (STROKE_EMBEDDING_SIZE floats per
+// candidate) come closest to that of s, in their original order.  Returns
+// cands itself if it has no more than k entries or if s has no shape.
+boost::shared_ptr<std::vector<Candidate> > retrieve(const Stroke *s, boost::shared_ptr<std::vector<Candidate> > cands,
+		const std::vector<float> &embeddings, int k);
+
+// The candidates whose coarse score (see Stroke::compare_coarse) is within
+// margin of the best coarse score of their group, in their original order.
+// per_button has the same meaning as for score_candidates.  Makes the
+// coarse copies of the strokes that don't have one yet.  Candidates that
+// are left once the deadline has passed are all kept.
+boost::shared_ptr<std::vector<Candidate> > coarse_filter(const Stroke *s, bool per_button,
+		boost::shared_ptr<std::vector<Candidate> > cands, double margin, Deadline deadline = Deadline::max());
+
+// Splits [0, n) into contiguous parts and calls f(begin, end, ctx) for each
+// of them on the worker pool.  Without a pool, f is called once on the
+// calling thread with the given context.
+void run_parallel(size_t n, stroke_compare_ctx_t *ctx, std::function<void(size_t, size_t, stroke_compare_ctx_t *)> f);
+#endif
@@ -53,7 +53,17 @@ PrefDB::PrefDB() :
 	tray_feedback(false),
 	show_osd(true),
 	move_back(false),
-	whitelist(false)
+	whitelist(false),
+	resample_points(0),
+	match_threads(1),
+	ranking_size(10),
+	retrieval_k(0),
+	coarse_margin(0.0),
+	compact_strokes(false),
+	recognition_budget(0),
+	prototypes(0),
+	prototype_margin(0.1),
+	prematch(false)
 {}
 
 template<class Archive> void PrefDB::serialize(Archive & ar, const unsigned int version) {
@@ -133,6 +143,27 @@ template<class Archive> void PrefDB::serialize(Archive & ar, const unsigned int
 	ar & boost::serialization::make_nvp("device_timeout", device_timeout.unsafe_ref());
 	if (version < 18) return;
 	ar & boost::serialization::make_nvp("whitelist", whitelist.unsafe_ref());
+	if (version < 19) return;
+	ar & boost::serialization::make_nvp("resample_points", resample_points.unsafe_ref());
+	if (version < 20) return;
+	ar & boost::serialization::make_nvp("match_threads", match_threads.unsafe_ref());
+	if (version < 21) return;
+	ar & boost::serialization::make_nvp("ranking_size", ranking_size.unsafe_ref());
+	if (version < 22) return;
+	ar & boost::serialization::make_nvp("device_decimation", device_decimation.unsafe_ref());
+	if (version < 23) return;
+	ar & boost::serialization::make_nvp("retrieval_k", retrieval_k.unsafe_ref());
+	if (version < 24) return;
+	ar & boost::serialization::make_nvp("coarse_margin", coarse_margin.unsafe_ref());
+	if (version < 25) return;
+	ar & boost::serialization::make_nvp("compact_strokes", compact_strokes.unsafe_ref());
+	if (version < 26) return;
+	ar & boost::serialization::make_nvp("recognition_budget", recognition_budget.unsafe_ref());
+	if (version < 27) return;
+	ar & boost::serialization::make_nvp("prototypes", prototypes.unsafe_ref());
+	ar & boost::serialization::make_nvp("prototype_margin", prototype_margin.unsafe_ref());
+	if (version < 28) return;
+	ar & boost::serialization::make_nvp("prematch", prematch.unsafe_ref());
 }
 
 void PrefDB::timeout() {
@@ -98,6 +98,19 @@ struct RGBA {
 
 extern const ButtonInfo default_button;
 
+// Motion events that are closer than step pixels to the last point of the
+// stroke are left out of it.  With keep_turns, a left-out point is put back
+// if the stroke turns sharply there.
+struct Decimation {
+	int step;
+	bool keep_turns;
+	Decimation() : step(0), keep_turns(true) {}
+	template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+		ar & boost::serialization::make_nvp("step", step);
+		ar & boost::serialization::make_nvp("keep_turns", keep_turns);
+	}
+};
+
 class PrefDB : public TimeoutWatcher {
 	friend class boost::serialization::access;
 	bool good_state;
@@ -134,12 +147,23 @@ public:
 	PrefSource<bool> move_back;
 	PrefSource<std::map<std::string, TimeoutType> > device_timeout;
 	PrefSource<bool> whitelist;
+	PrefSource<int> resample_points;
+	PrefSource<int> match_threads;
+	PrefSource<int> ranking_size;
+	PrefSource<std::map<std::string, Decimation> > device_decimation;
+	PrefSource<int> retrieval_k;
+	PrefSource<double> coarse_margin;
+	PrefSource<bool> compact_strokes;
+	PrefSource<int> recognition_budget;
+	PrefSource<int> prototypes;
+	PrefSource<double> prototype_margin;
+	PrefSource<bool> prematch;
 
 	void init();
 	virtual void timeout();
 };
 
-BOOST_CLASS_VERSION(PrefDB, 18)
+BOOST_CLASS_VERSION(PrefDB, 28)
 
 extern PrefDB prefs;
 
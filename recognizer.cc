@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2008-2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "recognizer.h"
+
+namespace {
+
+// Time warping, quadratic in the number of points
+class DTW : public Recognizer {
+public:
+	virtual const char *name() const { return "dtw"; }
+	virtual double cost(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, double cutoff) const {
+		return ctx ?
+			stroke_compare_with(ctx, a, b, nullptr, nullptr, cutoff) :
+			stroke_compare_bounded(a, b, nullptr, nullptr, cutoff);
+	}
+	virtual bool bounded() const { return true; }
+};
+
+// Direction vectors at fixed positions, in constant time once the strokes
+// are finished
+class Directions : public Recognizer {
+public:
+	virtual const char *name() const { return "directions"; }
+	virtual double cost(stroke_compare_ctx_t *, const stroke_t *a, const stroke_t *b, double cutoff) const {
+		double c = stroke_compare_directions(a, b);
+		return c < cutoff ? c : stroke_infinity;
+	}
+	virtual bool bounded() const { return false; }
+};
+
+const DTW dtw_engine;
+const Directions directions_engine;
+const Recognizer *const engines[] = { &dtw_engine, &directions_engine };
+
+}
+
+const Recognizer *Recognizer::get(const std::string &name) {
+	for (unsigned int i = 0; i < sizeof(engines)/sizeof(*engines); i++)
+		if (name == engines[i]->name())
+			return engines[i];
+	return &dtw_engine;
+}
+
+const Recognizer *Recognizer::dtw() {
+	return &dtw_engine;
+}
+
+std::vector<const Recognizer *> Recognizer::all() {
+	return std::vector<const Recognizer *>(engines, engines + sizeof(engines)/sizeof(*engines));
+}
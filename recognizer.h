@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2008-2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __RECOGNIZER_H__
+#define __RECOGNIZER_H__
+#include "stroke.h"
+#include <string>
+#include <vector>
+
+// A way of comparing two strokes.  Costs are on the scale of
+// stroke_compare(), so that Stroke::compare() can turn them into scores the
+// same way for every engine.
+class Recognizer {
+public:
+	virtual ~Recognizer() {}
+	virtual const char *name() const = 0;
+	// Anything that isn't below cutoff may come out as stroke_infinity
+	virtual double cost(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, double cutoff) const = 0;
+	// Whether the lower bounds from stroke.h hold for cost()
+	virtual bool bounded() const = 0;
+
+	// The engine of that name, or the DTW engine if there is none
+	static const Recognizer *get(const std::string &name);
+	static const Recognizer *dtw();
+	static std::vector<const Recognizer *> all();
+};
+#endif
@@ -19,9 +19,11 @@
 #include <iomanip>
 #include <glibmm/i18n.h>
 #include <sys/time.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 Stats::Stats() {
-	Gtk::Button *button_matrix;
 	widgets->get_widget("button_matrix", button_matrix);
 	widgets->get_widget("treeview_recent", recent_view);
 	widgets->get_widget("treeview_ranking", ranking_view);
@@ -168,9 +170,9 @@ Glib::RefPtr<Gdk::Pixbuf> Stroke::drawDebug(RStroke a, RStroke b, int size) {
 					(a->time(s+1)-a->time(s))*size, (b->time(t+1)-b->time(t))*size);
 			ctx->fill();
 		}
-	int path_x[a->size() + b->size()];
-	int path_y[a->size() + b->size()];
-	stroke_compare(a->stroke.get(), b->stroke.get(), path_x, path_y);
+	const CompareCache::Result &cached = CompareCache::get(a, b, true);
+	const int *path_x = cached.path_x.data();
+	const int *path_y = cached.path_y.data();
 	ctx->set_source_rgba(1,0,0,1);
 	ctx->set_line_width(2);
 	ctx->move_to(size, 0);
@@ -204,7 +206,10 @@ bool Stats::on_stroke(RRanking r) {
 	Gtk::TreeModel::Row row = *(recent_store->prepend());
 	row[cols.stroke] = r->stroke->draw(STROKE_SIZE);
 	row[cols.name] = r->name;
-	row[cols.score] = format_float(r->score*100) + "%";
+	Glib::ustring score = format_float(r->score*100) + "%";
+	if (r->partial)
+		score += Glib::ustring(" ") + _("(partial)");
+	row[cols.score] = score;
 	Glib::RefPtr<Gtk::ListStore> ranking_store = Gtk::ListStore::create(cols);
 	row[cols.child] = ranking_store;
 
@@ -219,30 +224,133 @@ bool Stats::on_stroke(RRanking r) {
 
 	}
 
-	for (std::multimap<double, std::pair<std::string, RStroke> >::iterator i = r->r.begin(); i != r->r.end(); i++) {
-		Gtk::TreeModel::Row row2 = *(ranking_store->prepend());
-		row2[cols.stroke] = i->second.second->draw(STROKE_SIZE);
-		row2[cols.debug] = Stroke::drawDebug(r->stroke, i->second.second, STROKE_SIZE);
-		row2[cols.name] = i->second.first;
-		row2[cols.score] = format_float(i->first * 100) + "%";
+	for (TopK::iterator i = r->r.begin(); i != r->r.end(); i++) {
+		Gtk::TreeModel::Row row2 = *(ranking_store->append());
+		RStroke s = r->get_stroke(*i);
+		row2[cols.stroke] = s->draw(STROKE_SIZE);
+		row2[cols.debug] = Stroke::drawDebug(r->stroke, s, STROKE_SIZE);
+		row2[cols.name] = r->get_name(*i);
+		row2[cols.score] = format_float(i->score * 100) + "%";
 	}
 	return false;
 }
 
-void Stats::on_pdf() {
-	struct timeval tv1, tv2;
-	gettimeofday(&tv1, 0);
+// The score matrix of all strokes, computed and written to /tmp/strokes.csv
+// on a thread of its own.  Results from the CompareCache are filled in
+// beforehand, and new ones go into the cache once the job is done, since the
+// cache may only be used on the main thread.  The same goes for drawing the
+// strokes (modifier labels come from GTK), so /tmp/strokes.pdf is rendered
+// by the main thread as well.
+struct MatrixJob {
+	std::vector<RStroke> strokes;
+	std::vector<char> known;
+	std::vector<int> matches;
+	std::vector<double> scores;
+	std::vector<double> costs;
+	std::atomic<int> progress;
+	std::atomic<bool> done;
+	struct timeval start;
+	std::thread thread;
+
+	MatrixJob(const std::list<RStroke> &s);
+	void run();
+	void compare();
+	void render();
+	void write_csv();
+	~MatrixJob() {
+		if (thread.joinable())
+			thread.join();
+	}
+};
+
+MatrixJob::MatrixJob(const std::list<RStroke> &s) : strokes(s.begin(), s.end()), progress(0), done(false) {
+	gettimeofday(&start, 0);
+	const int n = strokes.size();
+	known.resize(n*n, 0);
+	matches.resize(n*n, -1);
+	scores.resize(n*n, 0.0);
+	costs.resize(n*n, -1.0);
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++) {
+			int k = i*n + j;
+			const CompareCache::Result *r = CompareCache::find(strokes[i], strokes[j]);
+			if (r) {
+				matches[k] = r->match;
+				scores[k] = r->score;
+				costs[k] = r->cost;
+				known[k] = 1;
+			} else if (i == j) {
+				// The DP follows the diagonal at no cost
+				matches[k] = 1;
+				scores[k] = 1.0;
+				costs[k] = strokes[i]->stroke ? 0.0 : -1.0;
+				known[k] = 1;
+			}
+		}
+}
+
+void MatrixJob::run() {
+	compare();
+	write_csv();
+	done = true;
+}
+
+// Both directions have to be compared: ties and rounding make the cost of a
+// pair depend slightly on the order of the strokes.
+void MatrixJob::compare() {
+	const int n = strokes.size();
+	// Recognition uses the same pool and has to wait for a part to finish,
+	// so the parts are kept to a fixed number of comparisons however many
+	// strokes there are
+	const size_t part = 256;
+	std::vector<int> all;
+	for (int k = 0; k < n*n; k++)
+		if (!known[k])
+			all.push_back(k);
+	stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+	for (size_t p0 = 0; p0 < all.size(); p0 += part) {
+		const int *todo = all.data() + p0;
+		size_t size = std::min(part, all.size() - p0);
+		// Each row of a part goes to Stroke::compare_many() in one batch
+		run_parallel(size, ctx, [&](size_t begin, size_t end, stroke_compare_ctx_t *ctx) {
+			std::vector<const Stroke *> bs;
+			std::vector<int> m;
+			std::vector<double> sc, co;
+			for (size_t t = begin; t < end;) {
+				int i = todo[t] / n;
+				size_t u = t;
+				bs.clear();
+				for (; u < end && todo[u] / n == i; u++)
+					bs.push_back(strokes[todo[u] % n].get());
+				int b = bs.size();
+				m.resize(b);
+				sc.resize(b);
+				co.resize(b);
+				Stroke::compare_many(strokes[i].get(), bs.data(), b, 0.0, ctx, m.data(), sc.data(), co.data());
+				for (int j = 0; j < b; j++) {
+					int k = todo[t + j];
+					matches[k] = m[j];
+					scores[k] = sc[j];
+					costs[k] = co[j];
+				}
+				t = u;
+			}
+		});
+		progress = 100 * (p0 + size) / all.size();
+	}
+	stroke_compare_ctx_free(ctx);
+}
+
+void MatrixJob::render() {
 	const int S = 32;
 	const int B = 1;
-	std::list<RStroke> strokes;
-	actions.get_root()->all_strokes(strokes);
 	const int n = strokes.size();
 	Cairo::RefPtr<Cairo::PdfSurface> surface = Cairo::PdfSurface::create("/tmp/strokes.pdf", (n+1)*S, (n+1)*S);
 	const Cairo::RefPtr<Cairo::Context> ctx = Cairo::Context::create(surface);
-	int k = 1;
-	for (std::list<RStroke>::iterator i = strokes.begin(); i != strokes.end(); i++, k++) {
-		(*i)->draw(surface, k*S+B, B, S-2*B, S-2*B);
-		(*i)->draw(surface, B, k*S+B, S-2*B, S-2*B);
+	for (int k = 1; k <= n; k++) {
+		const RStroke &i = strokes[k-1];
+		i->draw(surface, k*S+B, B, S-2*B, S-2*B);
+		i->draw(surface, B, k*S+B, S-2*B, S-2*B);
 
 		ctx->set_source_rgba(0,0,0,1);
 		ctx->set_line_width(1);
@@ -252,10 +360,9 @@ void Stats::on_pdf() {
 		ctx->line_to((n+1)*S-B, k*S);
 		ctx->stroke();
 
-		int l = 1;
-		for (std::list<RStroke>::iterator j = strokes.begin(); j != strokes.end(); j++, l++) {
-			double score;
-		        int match = Stroke::compare(*i, *j, score);
+		for (int l = 1; l <= n; l++) {
+			double score = scores[(k-1)*n + l-1];
+			int match = matches[(k-1)*n + l-1];
 			if (match < 0)
 				continue;
 			if (match) {
@@ -272,12 +379,68 @@ void Stats::on_pdf() {
 			ctx->show_text(str);
 		}
 	}
-	gettimeofday(&tv2, 0);
-	g_debug("creating table took %ld us\n", (tv2.tv_sec - tv1.tv_sec)*1000000 + tv2.tv_usec - tv1.tv_usec);
+}
+
+// One row per stroke in the order of the PDF.  Pairs that can't be compared
+// because their buttons or modifiers differ are left empty.
+void MatrixJob::write_csv() {
+	const int n = strokes.size();
+	FILE *f = fopen("/tmp/strokes.csv", "w");
+	if (!f) {
+		g_warning("Couldn't write /tmp/strokes.csv\n");
+		return;
+	}
+	for (int l = 1; l <= n; l++)
+		fprintf(f, ",%d", l);
+	fprintf(f, "\n");
+	for (int k = 1; k <= n; k++) {
+		fprintf(f, "%d", k);
+		for (int l = 1; l <= n; l++) {
+			int i = (k-1)*n + l-1;
+			if (matches[i] < 0)
+				fprintf(f, ",");
+			else
+				fprintf(f, ",%.6f", scores[i]);
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+}
+
+void Stats::on_pdf() {
+	if (matrix)
+		return;
+	std::list<RStroke> strokes;
+	actions.get_root()->all_strokes(strokes);
+	matrix.reset(new MatrixJob(strokes));
+	button_matrix->set_sensitive(false);
+	matrix->thread = std::thread(&MatrixJob::run, matrix.get());
+	Glib::signal_timeout().connect(sigc::mem_fun(*this, &Stats::on_matrix_progress), 200);
+}
+
+bool Stats::on_matrix_progress() {
+	if (!matrix->done) {
+		button_matrix->set_label(Glib::ustring::format(matrix->progress.load()) + "%");
+		return true;
+	}
+	matrix->thread.join();
+	matrix->render();
+	const int n = matrix->strokes.size();
+	if (CompareCache::has_room(n*n))
+		for (int k = 0; k < n*n; k++)
+			if (!matrix->known[k])
+				CompareCache::store(matrix->strokes[k/n], matrix->strokes[k%n], matrix->matches[k], matrix->scores[k], matrix->costs[k]);
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	g_debug("creating table took %ld us\n", (tv.tv_sec - matrix->start.tv_sec)*1000000 + tv.tv_usec - matrix->start.tv_usec);
+	matrix.reset();
+	button_matrix->set_label(_("_Matrix"));
+	button_matrix->set_sensitive(true);
 
 	if (!fork()) {
 		execlp("xdg-open", "xdg-open", "/tmp/strokes.pdf", nullptr);
 		exit(EXIT_FAILURE);
 	}
+	return false;
 }
 
@@ -21,22 +21,55 @@
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <string.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 const double stroke_infinity = 0.2;
+const double stroke_compare_tolerance = 1e-6;
 #define EPS 0.000001
+#define HIST_BINS 16
+/* Slack for the lower bounds: the DP rounds the end of a step to 1.0 once
+ * it is within EPS, and angles are single precision. */
+#define BOUND_SLACK 0.00001
 
-struct point {
-	double x;
-	double y;
-	double t;
-	double dt;
-	double alpha;
-};
-
+/* Finished strokes are kept as a structure of arrays.  The matcher only ever
+ * looks at t and alpha; x and y are only needed for drawing and
+ * serialization.  alpha is stored as packed floats so that whole rows of
+ * angle differences can be computed in SIMD registers.  t stays in double
+ * precision: the slope and EPS tests in step() are sensitive to it, and
+ * rounding it to float changes which steps are taken.
+ *
+ * hist[k] is the arc length spent going in a direction that falls into bin
+ * k; hist_mask has bit k set iff hist[k] > 0.  Both are used for the
+ * lower bounds below.
+ *
+ * embedding holds the direction of the stroke at STROKE_EMBEDDING_SIZE/2
+ * evenly spaced positions along the arc length, as cosine and sine, scaled
+ * so that the embedding of a stroke has unit length.
+ *
+ * A compact stroke has x, y, t and alpha replaced by the 16 bit versions
+ * qx, qy, qt and qalpha, see stroke_compact().  Everything that reads them
+ * goes through the accessors below, except for the DP, which works on
+ * copies that the public comparison functions expand into the context.
+ */
 struct _stroke_t {
 	int n;
 	int capacity;
-	struct point *p;
+	double *x;
+	double *y;
+	double *t;
+	float *alpha;
+	short *qx;
+	short *qy;
+	unsigned short *qt;
+	unsigned short *qalpha;
+	float hist[HIST_BINS];
+	unsigned int hist_mask;
+	float embedding[STROKE_EMBEDDING_SIZE];
 };
 
 stroke_t *stroke_alloc(int n) {
@@ -44,14 +77,36 @@ stroke_t *stroke_alloc(int n) {
 	stroke_t *s = malloc(sizeof(stroke_t));
 	s->n = 0;
 	s->capacity = n;
-	s->p = calloc(n, sizeof(struct point));
+	s->x = calloc(n, sizeof(double));
+	s->y = calloc(n, sizeof(double));
+	s->t = calloc(n, sizeof(double));
+	s->alpha = calloc(n, sizeof(float));
+	s->qx = NULL;
+	s->qy = NULL;
+	s->qt = NULL;
+	s->qalpha = NULL;
 	return s;
 }
 
+/* Finished coordinates lie in [0, 1], t in [0, 1] and alpha in [-1, 1]. */
+static inline double decode_xy(short q) { return q / 65534.0 + 0.5; }
+static inline double decode_t(unsigned short q) { return q / 65535.0; }
+static inline float decode_alpha(unsigned short q) { return q / 32767.5f - 1.0f; }
+
+static inline long quantize(double v, long lo, long hi) {
+	long q = lrint(v);
+	return q < lo ? lo : q > hi ? hi : q;
+}
+
+static inline double x_at(const stroke_t *s, int i) { return s->qx ? decode_xy(s->qx[i]) : s->x[i]; }
+static inline double y_at(const stroke_t *s, int i) { return s->qy ? decode_xy(s->qy[i]) : s->y[i]; }
+static inline double t_at(const stroke_t *s, int i) { return s->qt ? decode_t(s->qt[i]) : s->t[i]; }
+static inline float alpha_at(const stroke_t *s, int i) { return s->qalpha ? decode_alpha(s->qalpha[i]) : s->alpha[i]; }
+
 void stroke_add_point(stroke_t *s, double x, double y) {
 	assert(s->capacity > s->n);
-	s->p[s->n].x = x;
-	s->p[s->n].y = y;
+	s->x[s->n] = x;
+	s->y[s->n] = y;
 	s->n++;
 }
 
@@ -64,45 +119,162 @@ static inline double angle_difference(double alpha, double beta) {
 	return d;
 }
 
+static void compute_histogram(stroke_t *s) {
+	for (int k = 0; k < HIST_BINS; k++)
+		s->hist[k] = 0.0f;
+	s->hist_mask = 0;
+	for (int i = 0; i + 1 < s->n; i++) {
+		double dt = t_at(s, i+1) - t_at(s, i);
+		if (!(dt > 0.0))
+			continue;
+		int k = (int)((alpha_at(s, i) + 1.0f) * HIST_BINS / 2);
+		if (k >= HIST_BINS)
+			k = HIST_BINS - 1;
+		if (k < 0)
+			k = 0;
+		s->hist[k] += dt;
+		s->hist_mask |= 1u << k;
+	}
+}
+
 void stroke_finish(stroke_t *s) {
 	assert(s->capacity > 0);
 	s->capacity = -1;
 
 	int n = s->n - 1;
 	double total = 0.0;
-	s->p[0].t = 0.0;
+	double *t = malloc(s->n * sizeof(double));
+	t[0] = 0.0;
 	for (int i = 0; i < n; i++) {
-		total += hypot(s->p[i+1].x - s->p[i].x, s->p[i+1].y - s->p[i].y);
-		s->p[i+1].t = total;
+		total += hypot(s->x[i+1] - s->x[i], s->y[i+1] - s->y[i]);
+		t[i+1] = total;
 	}
 	for (int i = 0; i <= n; i++)
-		s->p[i].t /= total;
-	double minX = s->p[0].x, minY = s->p[0].y, maxX = minX, maxY = minY;
+		s->t[i] = t[i] / total;
+	free(t);
+	double minX = s->x[0], minY = s->y[0], maxX = minX, maxY = minY;
 	for (int i = 1; i <= n; i++) {
-		if (s->p[i].x < minX) minX = s->p[i].x;
-		if (s->p[i].x > maxX) maxX = s->p[i].x;
-		if (s->p[i].y < minY) minY = s->p[i].y;
-		if (s->p[i].y > maxY) maxY = s->p[i].y;
+		if (s->x[i] < minX) minX = s->x[i];
+		if (s->x[i] > maxX) maxX = s->x[i];
+		if (s->y[i] < minY) minY = s->y[i];
+		if (s->y[i] > maxY) maxY = s->y[i];
 	}
 	double scaleX = maxX - minX;
 	double scaleY = maxY - minY;
 	double scale = (scaleX > scaleY) ? scaleX : scaleY;
 	if (scale < 0.001) scale = 1;
 	for (int i = 0; i <= n; i++) {
-		s->p[i].x = (s->p[i].x-(minX+maxX)/2)/scale + 0.5;
-		s->p[i].y = (s->p[i].y-(minY+maxY)/2)/scale + 0.5;
+		s->x[i] = (s->x[i]-(minX+maxX)/2)/scale + 0.5;
+		s->y[i] = (s->y[i]-(minY+maxY)/2)/scale + 0.5;
 	}
 
-	for (int i = 0; i < n; i++) {
-		s->p[i].dt = s->p[i+1].t - s->p[i].t;
-		s->p[i].alpha = atan2(s->p[i+1].y - s->p[i].y, s->p[i+1].x - s->p[i].x)/M_PI;
+	for (int i = 0; i < n; i++)
+		s->alpha[i] = atan2(s->y[i+1] - s->y[i], s->x[i+1] - s->x[i])/M_PI;
+
+	compute_histogram(s);
+
+	const int E = STROKE_EMBEDDING_SIZE / 2;
+	const float norm = n > 0 ? 1.0f / sqrtf(E) : 0.0f;
+	for (int k = 0, i = 0; k < E; k++) {
+		double u = (k + 0.5) / E;
+		while (i + 1 < n && s->t[i+1] <= u)
+			i++;
+		double a = n > 0 ? s->alpha[i] * M_PI : 0.0;
+		s->embedding[2*k] = cos(a) * norm;
+		s->embedding[2*k+1] = sin(a) * norm;
+	}
+}
+
+/* Replace the points of an unfinished stroke by n points spaced evenly
+ * along its arc length, then finish it.  This makes the number of points,
+ * and thus the cost of comparing two strokes, independent of the rate at
+ * which the input device reports motion.
+ */
+void stroke_finish_resampled(stroke_t *s, int n) {
+	assert(s->capacity > 0);
+	double total = 0.0;
+	for (int i = 0; i + 1 < s->n; i++)
+		total += hypot(s->x[i+1] - s->x[i], s->y[i+1] - s->y[i]);
+	if (n < 2 || s->n < 2 || total < EPS) {
+		stroke_finish(s);
+		return;
+	}
+
+	double *x = malloc(n * sizeof(double));
+	double *y = malloc(n * sizeof(double));
+	int i = 0;
+	double pos = 0.0;
+	double len = hypot(s->x[1] - s->x[0], s->y[1] - s->y[0]);
+	for (int k = 0; k < n; k++) {
+		double target = total * k / (n - 1);
+		while (i + 2 < s->n && pos + len < target) {
+			pos += len;
+			i++;
+			len = hypot(s->x[i+1] - s->x[i], s->y[i+1] - s->y[i]);
+		}
+		double u = len > 0.0 ? (target - pos) / len : 0.0;
+		if (u > 1.0)
+			u = 1.0;
+		x[k] = s->x[i] + u * (s->x[i+1] - s->x[i]);
+		y[k] = s->y[i] + u * (s->y[i+1] - s->y[i]);
 	}
+	free(s->x);
+	free(s->y);
+	free(s->t);
+	free(s->alpha);
+	s->x = x;
+	s->y = y;
+	s->t = calloc(n, sizeof(double));
+	s->alpha = calloc(n, sizeof(float));
+	s->n = n;
+	s->capacity = n;
+	stroke_finish(s);
+}
 
+/* The histogram is recomputed from the rounded values, so that the lower
+ * bounds stay below what the DP computes from them.
+ */
+int stroke_is_compact(const stroke_t *s) {
+	return s->qt != NULL;
+}
+
+void stroke_compact(stroke_t *s) {
+	assert(s->capacity < 0);
+	if (s->qt)
+		return;
+	const int n = s->n;
+	s->qx = malloc(n * sizeof(short));
+	s->qy = malloc(n * sizeof(short));
+	s->qt = malloc(n * sizeof(unsigned short));
+	s->qalpha = malloc(n * sizeof(unsigned short));
+	for (int i = 0; i < n; i++) {
+		s->qx[i] = quantize((s->x[i] - 0.5) * 65534.0, -32767, 32767);
+		s->qy[i] = quantize((s->y[i] - 0.5) * 65534.0, -32767, 32767);
+		s->qt[i] = quantize(s->t[i] * 65535.0, 0, 65535);
+		s->qalpha[i] = quantize((s->alpha[i] + 1.0) * 32767.5, 0, 65535);
+	}
+	free(s->x);
+	free(s->y);
+	free(s->t);
+	free(s->alpha);
+	s->x = NULL;
+	s->y = NULL;
+	s->t = NULL;
+	s->alpha = NULL;
+	compute_histogram(s);
 }
 
 void stroke_free(stroke_t *s) {
-	if (s)
-		free(s->p);
+	if (s) {
+		free(s->x);
+		free(s->y);
+		free(s->t);
+		free(s->alpha);
+		free(s->qx);
+		free(s->qy);
+		free(s->qt);
+		free(s->qalpha);
+	}
 	free(s);
 }
 
@@ -111,19 +283,19 @@ int stroke_get_size(const stroke_t *s) { return s->n; }
 void stroke_get_point(const stroke_t *s, int n, double *x, double *y) {
 	assert(n < s->n);
 	if (x)
-		*x = s->p[n].x;
+		*x = x_at(s, n);
 	if (y)
-		*y = s->p[n].y;
+		*y = y_at(s, n);
 }
 
 double stroke_get_time(const stroke_t *s, int n) {
 	assert(n < s->n);
-	return s->p[n].t;
+	return t_at(s, n);
 }
 
 double stroke_get_angle(const stroke_t *s, int n) {
 	assert(n+1 < s->n);
-	return s->p[n].alpha;
+	return alpha_at(s, n);
 }
 
 inline static double sqr(double x) { return x*x; }
@@ -132,12 +304,207 @@ double stroke_angle_difference(const stroke_t *a, const stroke_t *b, int i, int
 	return fabs(angle_difference(stroke_get_angle(a, i), stroke_get_angle(b, j)));
 }
 
+static inline float angle_difference_sqr(float alpha, float beta) {
+	float d = alpha - beta;
+	if (d < -1.0f)
+		d += 2.0f;
+	else if (d > 1.0f)
+		d -= 2.0f;
+	return d*d;
+}
+
+/* Lower bounds for stroke_compare.
+ *
+ * The cost of a path is a sum over pieces on which both strokes stay on one
+ * segment each, say i and j.  Such a piece contributes (dta + dtb) * ad(i, j),
+ * where dta and dtb are the amounts of time that it covers on either
+ * stroke.  The pieces cover [0, 1] exactly once on both strokes.
+ */
+
+/* The first piece pairs the first segments and covers at least as much time
+ * as the shorter one of them; the same goes for the last piece.
+ */
+double stroke_bound_endpoints(const stroke_t *a, const stroke_t *b) {
+	const int m = a->n - 1;
+	const int n = b->n - 1;
+	if (m < 1 || n < 1)
+		return 0.0;
+	double first = angle_difference_sqr(alpha_at(a, 0), alpha_at(b, 0)) *
+		fmin(t_at(a, 1), t_at(b, 1));
+	double last = angle_difference_sqr(alpha_at(a, m-1), alpha_at(b, n-1)) *
+		fmin(1.0 - t_at(a, m-1), 1.0 - t_at(b, n-1));
+	double bound = (m == 1 && n == 1) ? fmax(first, last) : first + last;
+	return fmax(bound - BOUND_SLACK, 0.0);
+}
+
+/* The time that a spends in direction bin k has to be paired with segments
+ * of b that are in some occupied bin of b, and two angles that are d bins
+ * apart differ by at least (d-1) bin widths.
+ */
+static double histogram_bound(const stroke_t *a, const stroke_t *b) {
+	double bound = 0.0;
+	for (int k = 0; k < HIST_BINS; k++) {
+		if (!(a->hist_mask & (1u << k)))
+			continue;
+		int d = 0;
+		while (d < HIST_BINS/2 &&
+				!(b->hist_mask & (1u << ((k + d) % HIST_BINS))) &&
+				!(b->hist_mask & (1u << ((k - d + HIST_BINS) % HIST_BINS))))
+			d++;
+		if (d >= 2)
+			bound += a->hist[k] * sqr((d - 1) * 2.0 / HIST_BINS);
+	}
+	return bound;
+}
+
+double stroke_bound_histogram(const stroke_t *a, const stroke_t *b) {
+	if (!a->hist_mask || !b->hist_mask)
+		return 0.0;
+	double bound = histogram_bound(a, b) + histogram_bound(b, a);
+	return fmax(bound - BOUND_SLACK, 0.0);
+}
+
+const float *stroke_get_embedding(const stroke_t *s) {
+	return s->embedding;
+}
+
+/* For a small angle difference d, 1 - cos(pi d) is about pi^2 d^2 / 2, and
+ * the weights of the DP add up to 2 along any path.
+ */
+double stroke_compare_directions(const stroke_t *a, const stroke_t *b) {
+	float dot = 0.0f;
+	for (int d = 0; d < STROKE_EMBEDDING_SIZE; d++)
+		dot += a->embedding[d] * b->embedding[d];
+	double cost = 4.0 * (1.0 - dot) / (M_PI * M_PI);
+	if (cost < 0.0)
+		cost = 0.0;
+	return cost < stroke_infinity ? cost : stroke_infinity;
+}
+
+/* Sift entry i of a min-heap of (score, index) pairs down */
+static void heap_down(float *score, int *index, int k, int i) {
+	for (;;) {
+		int c = 2*i + 1;
+		if (c >= k)
+			return;
+		if (c + 1 < k && score[c+1] < score[c])
+			c++;
+		if (score[i] <= score[c])
+			return;
+		float ts = score[i]; score[i] = score[c]; score[c] = ts;
+		int ti = index[i]; index[i] = index[c]; index[c] = ti;
+		i = c;
+	}
+}
+
+static int compare_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+int stroke_nearest(const float *e, const float *embeddings, int n, int k, int *out) {
+	if (k > n)
+		k = n;
+	if (k <= 0)
+		return 0;
+	float *best = malloc(k * sizeof(float));
+	for (int j = 0; j < n; j++) {
+		const float *f = embeddings + (size_t)j * STROKE_EMBEDDING_SIZE;
+		float dot = 0.0f;
+		for (int d = 0; d < STROKE_EMBEDDING_SIZE; d++)
+			dot += e[d] * f[d];
+		if (j < k) {
+			best[j] = dot;
+			out[j] = j;
+			if (j == k - 1)
+				for (int i = k/2; i >= 0; i--)
+					heap_down(best, out, k, i);
+		} else if (dot > best[0]) {
+			best[0] = dot;
+			out[0] = j;
+			heap_down(best, out, k, 0);
+		}
+	}
+	free(best);
+	qsort(out, k, sizeof(int), compare_int);
+	return k;
+}
+
+/* Fill out[j] with the squared angle difference between alpha and beta[j],
+ * for j = 0..n-1.  Uses AVX or SSE2 if the compiler targets them.
+ */
+static void angle_difference_sqr_row(float alpha, const float *beta, float *out, int n) {
+	int j = 0;
+#if defined(__AVX__)
+	const __m256 va = _mm256_set1_ps(alpha);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 mone = _mm256_set1_ps(-1.0f);
+	const __m256 two = _mm256_set1_ps(2.0f);
+	for (; j + 8 <= n; j += 8) {
+		__m256 d = _mm256_sub_ps(va, _mm256_loadu_ps(beta + j));
+		d = _mm256_add_ps(d, _mm256_and_ps(_mm256_cmp_ps(d, mone, _CMP_LT_OQ), two));
+		d = _mm256_sub_ps(d, _mm256_and_ps(_mm256_cmp_ps(d, one, _CMP_GT_OQ), two));
+		_mm256_storeu_ps(out + j, _mm256_mul_ps(d, d));
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128 va4 = _mm_set1_ps(alpha);
+	const __m128 one4 = _mm_set1_ps(1.0f);
+	const __m128 mone4 = _mm_set1_ps(-1.0f);
+	const __m128 two4 = _mm_set1_ps(2.0f);
+	for (; j + 4 <= n; j += 4) {
+		__m128 d = _mm_sub_ps(va4, _mm_loadu_ps(beta + j));
+		d = _mm_add_ps(d, _mm_and_ps(_mm_cmplt_ps(d, mone4), two4));
+		d = _mm_sub_ps(d, _mm_and_ps(_mm_cmpgt_ps(d, one4), two4));
+		_mm_storeu_ps(out + j, _mm_mul_ps(d, d));
+	}
+#endif
+	for (; j < n; j++)
+		out[j] = angle_difference_sqr(alpha, beta[j]);
+}
+
+/* The DP only ever looks at a few rows past the one it is expanding, so
+ * rows are accessed through tables of row pointers.  When a path is wanted
+ * the rows live in one M x N table; otherwise they live in a ring of W rows
+ * that slides along with x, which keeps memory at O(N * W) for arbitrarily
+ * long strokes.  adrow[i] is NULL for angle rows that are not resident.
+ * expanded[k] holds the decoded t and alpha of a compact stroke.
+ */
+struct _stroke_compare_ctx_t {
+	size_t cells;
+	size_t path_cells;
+	size_t rows;
+	double *dist;
+	int *prev_x;
+	int *prev_y;
+	float *ad;
+	double *row_min;
+	double **drow;
+	float **adrow;
+
+	int ring_rows;
+	size_t ring_cols;
+	double *ring_dist;
+	float *ring_ad;
+	double *last_row;
+
+	stroke_t expanded[2];
+	int expanded_size[2];
+};
+
+static inline float ad_at(const float *const *adrow, const stroke_t *a, const stroke_t *b, int i, int j) {
+	const float *row = adrow[i];
+	return row ? row[j] : angle_difference_sqr(a->alpha[i], b->alpha[j]);
+}
+
 static inline void step(const stroke_t *a,
 			const stroke_t *b,
 			const int N,
-			double *dist,
+			const float *const *adrow,
+			double *const *drow,
 			int *prev_x,
 			int *prev_y,
+			double *row_min,
+			const bool track,
 			const int x,
 			const int y,
 			const double tx,
@@ -146,96 +513,302 @@ static inline void step(const stroke_t *a,
 			const int x2,
 			const int y2)
 {
-	double dtx = a->p[x2].t - tx;
-	double dty = b->p[y2].t - ty;
+	const double *at = a->t;
+	const double *bt = b->t;
+	double dtx = at[x2] - tx;
+	double dty = bt[y2] - ty;
 	if (dtx >= dty * 2.2 || dty >= dtx * 2.2 || dtx < EPS || dty < EPS)
 		return;
 	(*k)++;
 
 	double d = 0.0;
 	int i = x, j = y;
-	double next_tx = (a->p[i+1].t - tx) / dtx;
-	double next_ty = (b->p[j+1].t - ty) / dty;
+	double next_tx = (at[i+1] - tx) / dtx;
+	double next_ty = (bt[j+1] - ty) / dty;
 	double cur_t = 0.0;
 
 	for (;;) {
-		double ad = sqr(angle_difference(a->p[i].alpha, b->p[j].alpha));
 		double next_t = next_tx < next_ty ? next_tx : next_ty;
 		bool done = next_t >= 1.0 - EPS;
 		if (done)
 			next_t = 1.0;
-		d += (next_t - cur_t)*ad;
+		d += (next_t - cur_t)*ad_at(adrow, a, b, i, j);
 		if (done)
 			break;
 		cur_t = next_t;
 		if (next_tx < next_ty)
-			next_tx = (a->p[++i+1].t - tx) / dtx;
+			next_tx = (at[++i+1] - tx) / dtx;
 		else
-			next_ty = (b->p[++j+1].t - ty) / dty;
+			next_ty = (bt[++j+1] - ty) / dty;
 	}
-	double new_dist = dist[x*N+y] + d * (dtx + dty);
+	double new_dist = drow[x][y] + d * (dtx + dty);
 	if (new_dist != new_dist) abort();
 
-	if (new_dist >= dist[x2*N+y2])
+	if (new_dist >= drow[x2][y2])
 		return;
 
-	prev_x[x2*N+y2] = x;
-	prev_y[x2*N+y2] = y;
-	dist[x2*N+y2] = new_dist;
+	if (track) {
+		prev_x[x2*N+y2] = x;
+		prev_y[x2*N+y2] = y;
+	}
+	drow[x2][y2] = new_dist;
+	if (new_dist < row_min[x2])
+		row_min[x2] = new_dist;
+}
+
+stroke_compare_ctx_t *stroke_compare_ctx_alloc(void) {
+	return calloc(1, sizeof(stroke_compare_ctx_t));
+}
+
+void stroke_compare_ctx_free(stroke_compare_ctx_t *ctx) {
+	if (ctx) {
+		free(ctx->dist);
+		free(ctx->prev_x);
+		free(ctx->prev_y);
+		free(ctx->ad);
+		free(ctx->row_min);
+		free(ctx->drow);
+		free(ctx->adrow);
+		free(ctx->ring_dist);
+		free(ctx->ring_ad);
+		free(ctx->last_row);
+		for (int k = 0; k < 2; k++) {
+			free(ctx->expanded[k].t);
+			free(ctx->expanded[k].alpha);
+		}
+	}
+	free(ctx);
+}
+
+/* Make room for an M x N comparison.  The buffers only ever grow, so once
+ * a context has seen the largest pair of strokes it won't allocate again.
+ * The full tables are only needed to recover the path.
+ */
+static void ctx_reserve(stroke_compare_ctx_t *ctx, int M, int N, bool track) {
+	size_t cells = (size_t)M * N;
+	if (track && cells > ctx->cells) {
+		free(ctx->dist);
+		free(ctx->ad);
+		ctx->dist   = malloc(cells * sizeof(double));
+		ctx->ad     = malloc(cells * sizeof(float));
+		ctx->cells = cells;
+	}
+	if (track && cells > ctx->path_cells) {
+		free(ctx->prev_x);
+		free(ctx->prev_y);
+		ctx->prev_x = malloc(cells * sizeof(int));
+		ctx->prev_y = malloc(cells * sizeof(int));
+		ctx->path_cells = cells;
+	}
+	if ((size_t)M > ctx->rows) {
+		free(ctx->row_min);
+		free(ctx->drow);
+		free(ctx->adrow);
+		ctx->row_min = malloc(M * sizeof(double));
+		ctx->drow = malloc(M * sizeof(double *));
+		ctx->adrow = malloc(M * sizeof(float *));
+		ctx->rows = M;
+	}
+	if (!track && (size_t)N > ctx->ring_cols) {
+		free(ctx->ring_dist);
+		free(ctx->ring_ad);
+		free(ctx->last_row);
+		ctx->ring_dist = NULL;
+		ctx->ring_ad = NULL;
+		ctx->ring_rows = 0;
+		ctx->last_row = malloc(N * sizeof(double));
+		ctx->ring_cols = N;
+	}
+}
+
+/* Make rows [lo, hi) of the ring resident: every dist cell starts out at
+ * infinity and the angle row is computed.
+ */
+static void ring_fill(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, int lo, int hi) {
+	const int N = b->n;
+	const int n = N - 1;
+	const int mask = ctx->ring_rows - 1;
+	for (int i = lo; i < hi; i++) {
+		double *dist = ctx->ring_dist + (size_t)(i & mask) * ctx->ring_cols;
+		float *ad = ctx->ring_ad + (size_t)(i & mask) * ctx->ring_cols;
+		for (int j = 0; j < n; j++)
+			dist[j] = stroke_infinity;
+		angle_difference_sqr_row(a->alpha[i], b->alpha, ad, n);
+		ctx->drow[i] = dist;
+		ctx->adrow[i] = ad;
+	}
+}
+
+/* Grow the ring so that it holds at least rows [x, hi), keeping the
+ * contents of the rows that are already resident.
+ */
+static void ring_grow(stroke_compare_ctx_t *ctx, int x, int end, int hi) {
+	int rows = ctx->ring_rows ? ctx->ring_rows : 16;
+	while (rows < hi - x)
+		rows *= 2;
+	size_t cols = ctx->ring_cols;
+	double *ring_dist = malloc(rows * cols * sizeof(double));
+	float *ring_ad = malloc(rows * cols * sizeof(float));
+	for (int i = x; i < end; i++) {
+		double *dist = ring_dist + (size_t)(i & (rows - 1)) * cols;
+		float *ad = ring_ad + (size_t)(i & (rows - 1)) * cols;
+		memcpy(dist, ctx->drow[i], cols * sizeof(double));
+		memcpy(ad, ctx->adrow[i], cols * sizeof(float));
+		ctx->drow[i] = dist;
+		ctx->adrow[i] = ad;
+	}
+	free(ctx->ring_dist);
+	free(ctx->ring_ad);
+	ctx->ring_dist = ring_dist;
+	ctx->ring_ad = ring_ad;
+	ctx->ring_rows = rows;
 }
 
 /* To compare two gestures, we use dynamic programming to minimize (an
  * approximation) of the integral over square of the angle difference among
  * (roughly) all reparametrizations whose slope is always between 1/2 and 2.
+ *
+ * Every step strictly increases x, so once all cells of row x have been
+ * expanded, each remaining path has to pass through a cell of a later row
+ * that already holds its final distance.  Costs only grow along a path,
+ * so if none of those cells is below the cutoff, neither is the result.
+ * The same argument means that rows before x are never looked at again,
+ * which is what makes the rolling window possible.
+ *
+ * track is a compile-time constant in all callers below, so the cost-only
+ * variant is specialized to never touch the back-pointer arrays.  So is
+ * fixed: if it is nonzero, both strokes have exactly that many points, the
+ * caller provides the tables in ft, and the compiler gets to see all the
+ * loop bounds.
  */
-double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y) {
-	const int M = a->n;
-	const int N = b->n;
+#define FIXED_MAX 64
+
+struct fixed_tables {
+	double dist[FIXED_MAX * FIXED_MAX];
+	float ad[FIXED_MAX * FIXED_MAX];
+	double *drow[FIXED_MAX];
+	float *adrow[FIXED_MAX];
+	double row_min[FIXED_MAX];
+};
+
+static inline __attribute__((always_inline))
+double compare_dp(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b,
+		int *path_x, int *path_y, double cutoff, const bool track,
+		const int fixed, struct fixed_tables *ft) {
+	const int M = fixed ? fixed : a->n;
+	const int N = fixed ? fixed : b->n;
 	const int m = M - 1;
 	const int n = N - 1;
+	if (cutoff > stroke_infinity)
+		cutoff = stroke_infinity;
 
-	double* dist = malloc(M * N * sizeof(double));
-	int* prev_x  = malloc(M * N * sizeof(int));
-	int* prev_y  = malloc(M * N * sizeof(int));
+	int *prev_x = NULL;
+	int *prev_y = NULL;
+	double *row_min;
+	double **drow;
+	float **adrow;
+	if (fixed) {
+		row_min = ft->row_min;
+		drow = ft->drow;
+		adrow = ft->adrow;
+	} else {
+		ctx_reserve(ctx, M, N, track);
+		prev_x = ctx->prev_x;
+		prev_y = ctx->prev_y;
+		row_min = ctx->row_min;
+		drow = ctx->drow;
+		adrow = ctx->adrow;
+	}
 	for (int i = 0; i < m; i++)
-		for (int j = 0; j < n; j++)
-			dist[i*N+j] = stroke_infinity;
-	dist[M*N-1] = stroke_infinity;
-	dist[0] = 0.0;
+		row_min[i] = stroke_infinity;
+	row_min[m] = stroke_infinity;
+
+	// Rows [0, end) are resident
+	int end;
+	if (track || fixed) {
+		double *dist = fixed ? ft->dist : ctx->dist;
+		float *ad = fixed ? ft->ad : ctx->ad;
+		for (int i = 0; i < m; i++) {
+			drow[i] = dist + i*N;
+			adrow[i] = ad + i*n;
+			angle_difference_sqr_row(a->alpha[i], b->alpha, adrow[i], n);
+			for (int j = 0; j < n; j++)
+				drow[i][j] = stroke_infinity;
+		}
+		drow[m] = dist + m*N;
+		end = m;
+	} else {
+		if (!ctx->ring_rows)
+			ring_grow(ctx, 0, 0, 1);
+		end = ctx->ring_rows < m ? ctx->ring_rows : m;
+		ring_fill(ctx, a, b, 0, end);
+		for (int i = end; i < m; i++)
+			adrow[i] = NULL;
+		drow[m] = ctx->last_row;
+	}
+	adrow[m] = NULL;
+	drow[m][n] = stroke_infinity;
+	drow[0][0] = 0.0;
+	row_min[0] = 0.0;
 
+	bool abandoned = false;
 	for (int x = 0; x < m; x++) {
 		for (int y = 0; y < n; y++) {
-			if (dist[x*N+y] >= stroke_infinity)
+			if (drow[x][y] >= cutoff)
 				continue;
-			double tx  = a->p[x].t;
-			double ty  = b->p[y].t;
+			double tx  = a->t[x];
+			double ty  = b->t[y];
 			int max_x = x;
 			int max_y = y;
 			int k = 0;
 
 			while (k < 4) {
-				if (a->p[max_x+1].t - tx > b->p[max_y+1].t - ty) {
+				if (a->t[max_x+1] - tx > b->t[max_y+1] - ty) {
 					max_y++;
 					if (max_y == n) {
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, m, n);
+						step(a, b, N, (const float *const *)adrow, drow, prev_x, prev_y, row_min, track, x, y, tx, ty, &k, m, n);
 						break;
 					}
 					for (int x2 = x+1; x2 <= max_x; x2++)
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, x2, max_y);
+						step(a, b, N, (const float *const *)adrow, drow, prev_x, prev_y, row_min, track, x, y, tx, ty, &k, x2, max_y);
 				} else {
 					max_x++;
 					if (max_x == m) {
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, m, n);
+						step(a, b, N, (const float *const *)adrow, drow, prev_x, prev_y, row_min, track, x, y, tx, ty, &k, m, n);
 						break;
 					}
+					if (!track && max_x >= end) {
+						ring_grow(ctx, x, end, max_x + 1);
+						int hi = x + ctx->ring_rows < m ? x + ctx->ring_rows : m;
+						ring_fill(ctx, a, b, end, hi);
+						end = hi;
+					}
 					for (int y2 = y+1; y2 <= max_y; y2++)
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, max_x, y2);
+						step(a, b, N, (const float *const *)adrow, drow, prev_x, prev_y, row_min, track, x, y, tx, ty, &k, max_x, y2);
 				}
 			}
 		}
+		double frontier = row_min[m];
+		for (int x2 = x+1; x2 < m && frontier >= cutoff; x2++)
+			if (row_min[x2] < frontier)
+				frontier = row_min[x2];
+		if (frontier >= cutoff) {
+			abandoned = true;
+			break;
+		}
+		if (!track) {
+			// Slide the window: row x is done, its slot goes to row end
+			adrow[x] = NULL;
+			if (end < m) {
+				ring_fill(ctx, a, b, end, end + 1);
+				end++;
+			}
+		}
 	}
-	double cost = dist[M*N-1];
-	if (path_x && path_y) {
+	double cost = abandoned ? stroke_infinity : drow[m][n];
+	if (cost >= cutoff)
+		cost = stroke_infinity;
+	if (track) {
 		if (cost < stroke_infinity) {
 			int x = m;
 			int y = n;
@@ -254,9 +827,114 @@ double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *pa
 		}
 	}
 
-	free(prev_y);
-	free(prev_x);
-	free(dist);
+	return cost;
+}
 
+int stroke_use_fixed_size = 1;
+
+/* The tables for 64 points take about 50k of stack. */
+#define COMPARE_FIXED(N) \
+static double compare_fixed_##N(const stroke_t *a, const stroke_t *b, double cutoff) { \
+	struct fixed_tables ft; \
+	return compare_dp(NULL, a, b, NULL, NULL, cutoff, false, N, &ft); \
+}
+COMPARE_FIXED(16)
+COMPARE_FIXED(32)
+COMPARE_FIXED(64)
+
+static double compare_cost(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, double cutoff) {
+	if (stroke_use_fixed_size && a->n == b->n) {
+		switch (a->n) {
+			case 16: return compare_fixed_16(a, b, cutoff);
+			case 32: return compare_fixed_32(a, b, cutoff);
+			case 64: return compare_fixed_64(a, b, cutoff);
+		}
+	}
+	return compare_dp(ctx, a, b, NULL, NULL, cutoff, false, 0, NULL);
+}
+
+static double compare_path(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b,
+		int *path_x, int *path_y, double cutoff) {
+	return compare_dp(ctx, a, b, path_x, path_y, cutoff, true, 0, NULL);
+}
+
+/* Returns s itself if it isn't compact, otherwise a copy in slot k of the
+ * context that only has what the DP looks at.
+ */
+static const stroke_t *expand(stroke_compare_ctx_t *ctx, const stroke_t *s, int k) {
+	if (!s->qt)
+		return s;
+	stroke_t *e = &ctx->expanded[k];
+	if (s->n > ctx->expanded_size[k]) {
+		free(e->t);
+		free(e->alpha);
+		e->t = malloc(s->n * sizeof(double));
+		e->alpha = malloc(s->n * sizeof(float));
+		ctx->expanded_size[k] = s->n;
+	}
+	e->n = s->n;
+	for (int i = 0; i < s->n; i++) {
+		e->t[i] = decode_t(s->qt[i]);
+		e->alpha[i] = decode_alpha(s->qalpha[i]);
+	}
+	return e;
+}
+
+double stroke_compare_with(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b,
+		int *path_x, int *path_y, double cutoff) {
+	a = expand(ctx, a, 0);
+	b = expand(ctx, b, 1);
+	if (path_x && path_y)
+		return compare_path(ctx, a, b, path_x, path_y, cutoff);
+	return compare_cost(ctx, a, b, cutoff);
+}
+
+void stroke_compare_many_with(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *const *bs,
+		int n, double cutoff, double *costs) {
+	int max_n = 0;
+	for (int k = 0; k < n; k++)
+		if (bs[k] && bs[k]->n > max_n)
+			max_n = bs[k]->n;
+	if (!max_n) {
+		for (int k = 0; k < n; k++)
+			costs[k] = stroke_infinity;
+		return;
+	}
+	a = expand(ctx, a, 0);
+	ctx_reserve(ctx, a->n, max_n, false);
+	for (int k = 0; k < n; k++) {
+		const stroke_t *b = bs[k];
+		if (!b) {
+			costs[k] = stroke_infinity;
+			continue;
+		}
+		if (k + 1 < n && bs[k+1]) {
+			const stroke_t *next = bs[k+1];
+			if (next->qt) {
+				__builtin_prefetch(next->qalpha);
+				__builtin_prefetch(next->qt);
+			} else {
+				__builtin_prefetch(next->alpha);
+				__builtin_prefetch(next->t);
+			}
+		}
+		costs[k] = compare_cost(ctx, a, expand(ctx, b, 1), cutoff);
+	}
+}
+
+void stroke_compare_many(const stroke_t *a, const stroke_t *const *bs, int n, double cutoff, double *costs) {
+	stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+	stroke_compare_many_with(ctx, a, bs, n, cutoff, costs);
+	stroke_compare_ctx_free(ctx);
+}
+
+double stroke_compare_bounded(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, double cutoff) {
+	stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+	double cost = stroke_compare_with(ctx, a, b, path_x, path_y, cutoff);
+	stroke_compare_ctx_free(ctx);
 	return cost;
 }
+
+double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y) {
+	return stroke_compare_bounded(a, b, path_x, path_y, stroke_infinity);
+}
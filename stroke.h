@@ -24,10 +24,24 @@ struct _stroke_t;
 
 typedef struct _stroke_t stroke_t;
 
+struct _stroke_compare_ctx_t;
+
+/* Scratch space for stroke comparisons.  Reusing one context for a whole
+ * recognition pass avoids allocating per comparison.  A context must not be
+ * used by two threads at the same time. */
+typedef struct _stroke_compare_ctx_t stroke_compare_ctx_t;
+
 stroke_t *stroke_alloc(int n);
 void stroke_add_point(stroke_t *stroke, double x, double y);
 void stroke_finish(stroke_t *stroke);
+void stroke_finish_resampled(stroke_t *stroke, int n);
 void stroke_free(stroke_t *stroke);
+/* Stores the points of a finished stroke in 16 bits per coordinate, time
+ * and angle, about a quarter of the memory.  Everything keeps working on
+ * the rounded values, which are within 2e-5 of the exact ones, so
+ * comparisons with a compact stroke come out slightly different. */
+void stroke_compact(stroke_t *stroke);
+int stroke_is_compact(const stroke_t *stroke);
 
 int stroke_get_size(const stroke_t *stroke);
 void stroke_get_point(const stroke_t *stroke, int n, double *x, double *y);
@@ -36,8 +50,51 @@ double stroke_get_angle(const stroke_t *stroke, int n);
 double stroke_angle_difference(const stroke_t *a, const stroke_t *b, int i, int j);
 
 double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y);
+/* Like stroke_compare, but gives up and returns stroke_infinity as soon as
+ * it is clear that the cost will not be below cutoff. */
+double stroke_compare_bounded(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, double cutoff);
+
+/* Cheap lower bounds on the result of stroke_compare. */
+double stroke_bound_endpoints(const stroke_t *a, const stroke_t *b);
+double stroke_bound_histogram(const stroke_t *a, const stroke_t *b);
+
+/* A fixed-length summary of the shape of a stroke.  The dot product of the
+ * embeddings of two strokes is 1 if they go in the same direction all along
+ * and smaller the more their directions differ. */
+#define STROKE_EMBEDDING_SIZE 32
+const float *stroke_get_embedding(const stroke_t *s);
+/* A closed-form alternative to stroke_compare in constant time, in the
+ * manner of Protractor: compares the directions in the embeddings position
+ * by position, without any time warping.  The result is on about the same
+ * scale as that of stroke_compare, but the lower bounds don't apply. */
+double stroke_compare_directions(const stroke_t *a, const stroke_t *b);
+/* Finds the k rows of embeddings, which has n rows of STROKE_EMBEDDING_SIZE
+ * floats, that have the largest dot product with e.  Their indices are
+ * stored in out in increasing order; returns how many there are. */
+int stroke_nearest(const float *e, const float *embeddings, int n, int k, int *out);
+
+stroke_compare_ctx_t *stroke_compare_ctx_alloc(void);
+void stroke_compare_ctx_free(stroke_compare_ctx_t *ctx);
+double stroke_compare_with(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b,
+		int *path_x, int *path_y, double cutoff);
+
+/* Compares a against each of bs[0], ..., bs[n-1] as stroke_compare_bounded
+ * would and stores the results in costs.  NULL entries of bs are skipped
+ * and get stroke_infinity.  The scratch space is set up once for the whole
+ * batch. */
+void stroke_compare_many(const stroke_t *a, const stroke_t *const *bs, int n, double cutoff, double *costs);
+void stroke_compare_many_with(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *const *bs,
+		int n, double cutoff, double *costs);
+
+/* Comparisons of two strokes that both have 16, 32 or 64 points, as
+ * stroke_finish_resampled produces them, use code specialized for that
+ * size.  Clearing this forces the generic code, for benchmarking. */
+extern int stroke_use_fixed_size;
 
 extern const double stroke_infinity;
+/* Angles are compared in single precision, so costs may differ from an
+ * all-double computation by up to this much. */
+extern const double stroke_compare_tolerance;
 
 #ifdef  __cplusplus
 }
@@ -156,5 +156,7 @@ public:
 		if (remove_timeout())
 			timeout();
 	}
+	// Returns whether a timeout was pending
+	bool cancel() { return remove_timeout(); }
 };
 #endif
@@ -60,14 +60,20 @@ private:
 
 extern Win *win;
 
+struct MatrixJob;
+
 class Stats {
 public:
 	Stats();
 	bool on_stroke(boost::shared_ptr<Ranking>);
 private:
 	void on_pdf();
+	bool on_matrix_progress();
 	void on_cursor_changed();
 
+	Gtk::Button *button_matrix;
+	boost::shared_ptr<MatrixJob> matrix;
+
 	class ModelColumns : public Gtk::TreeModel::ColumnRecord {
 	public:
 		ModelColumns() { add(stroke); add(debug); add(name); add(score); add(child); }